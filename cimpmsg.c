@@ -1,22 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <signal.h>
+#include <linux/io_uring.h>
 #include "dbg_err.h"
 #include "utlist.h"
 #include "cimpmsg.h"
 
 /*------------------------------------------------------------------
- * client receive should be blocking, but have a timeout so we can
-*  detect terminate flag 
+ * client receive should be blocking, with no timeout. It also waits
+*  on the client's eventfd, which cmsg_client_terminate signals. Only
+*  the hello of cmsg_connect_client_v2 is bounded, by CLIENT_HELLO_MSECS
 *  client send should be blocking
 * 
 *  server receive should be blocking
@@ -24,49 +36,518 @@
 ---------------------------------------------------------------------*/
 
 #define MSG_HEADER_MARK 0xEE
+#define MSG_HEADER_MARK_V2 0xEF
+#define MSG_HEADER_SIZE_V1 4
+#define MSG_HEADER_SIZE_V2 8
+#define MSG_HEADER_MAX 8
 
+// v2 header flags
+#define MSG_FLAG_HELLO 0x01	// protocol negotiation. payload is feature bits
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define OUTQ_FLUSH_FRAMES 64
+
+#define EPOLL_MAX_EVENTS 256
+#define EPOLL_MAX_ACCEPTS 64
+
+// one read buffer per reactor. partial msgs are carried by the connection
+#define CMSG_RCV_BUF_SIZE 65536
+
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 512	// must be a power of 2
+#define URING_BUF_SIZE 8192
+
+// each reactor counts for itself, so cores do not share a cache line
+#define STAT_ADD(rs, field, n) \
+  __atomic_fetch_add (&(rs)->stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_INC(rs, field) STAT_ADD (rs, field, 1)
+
+// a handle is generation << 32 | reactor id << 24 | socket
+#define HANDLE_SOCK_BITS 24
+#define MAX_REACTOR_THREADS 256
+
+// a frame encoded once and queued on many connections
+typedef struct shared_frame {
+  int refs;
+  size_t len;
+  char data[];
+} shared_frame_t;
+
+// unsent part of a frame, waiting for the socket to become writable.
+// data is the frame's own copy, or points into shared
+typedef struct out_frame {
+  char *data;
+  size_t len;
+  size_t sent;
+  struct shared_frame *shared;
+  struct out_frame * next;
+  char own[];
+} out_frame_t;
 
 typedef struct connection {
   int oserr;
   int rcv_state;
   bool rcv_selected;
+  bool snd_selected;
+  bool want_write;
+  bool send_inflight;	// io_uring sendmsg outstanding
+  struct out_frame * outq_head;
+  struct out_frame * outq_tail;
+  size_t outq_bytes;	// unsent
+  unsigned int outq_frames;
+  int inflight_frames;	// io_uring: outq frames the sendmsg points to
+  bool outq_overflowed;	// until the outq empties
+  bool slow_pending;	// CMSG_ACTION_SLOW_CONSUMER not yet given
+  bool outq_evict;	// to be dropped as a slow consumer
+  unsigned char rcv_header[MSG_HEADER_MAX];
+  size_t rcv_header_len;
+  int rcv_flags;
   size_t rcv_end_pos;
+  char *rcv_tmp;	// msg buffer allocated by the library, if any
+  int uring_pending;	// io_uring requests in flight for this connection
+  struct reactor_stuff *rs;	// the reactor that accepted it
+  struct handler_worker *worker;	// its home worker, if not the reactor
+  int refs;	// the reactor's, plus one per handler job queued
+  struct handler_job *mailbox;	// queued handler jobs, newest first
+  bool scheduled;	// on a worker's ready deque, or being run
+  struct connection *ready_prev;
+  struct connection *ready_next;
+  unsigned int queued_msgs;	// msgs queued for handlers, not yet handled
+  size_t queued_bytes;
+  bool rd_paused;	// not read until its queues drain
+  bool recv_stopped;	// io_uring: no recv armed while paused
+  int held_head;	// io_uring: bufs read while paused, oldest first
+  int held_tail;
+  bool removed;	// client reactor: to be dropped by its loop
   server_rcv_msg_data_t rcv_data;
+  struct connection * prev;
   struct connection * next;
 } connection_t;
 
+// Connections indexed by socket fd, for O(1) lookup on send.
+// A connection keeps its slot until it is closed, so walking the
+// table visits connections in the same order every pass.
+// gens[slot] is bumped each time a slot is reused; a handle carries
+// the slot and the generation it was issued with.
+struct conn_table {
+  struct connection **slots;
+  uint32_t *gens;
+  int size;
+  int high;	// one past the highest slot in use
+  int count;
+};
 
-static struct server_stuff {
-  unsigned int port;
-  struct sockaddr_in addr;
+// Connections mapped and pre-faulted at connect time, so an accept
+// burst takes them off a free list instead of going to the heap
+struct conn_slab {
+  struct connection *conns;
+  size_t size;	// bytes mapped
+  unsigned int count;
+  struct connection *free_list;
+  pthread_mutex_t mutex;
+};
+
+#define CONN_TABLE_FOREACH(table, i, conn) \
+  for ((i)=0; (i)<(table).high; (i)++) \
+    if (NULL != ((conn) = (table).slots[i]))
+
+struct uring_stuff {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *bufs;
+  unsigned short buf_tail;
+  int held_next[URING_BUF_COUNT];	// bufs paused connections hold
+  unsigned held_len[URING_BUF_COUNT];
+  pthread_t reactor_thread;
+  pthread_mutex_t sq_mutex;
+  struct connection * closing_list; // dropped, with requests in flight
+};
+
+// One event loop, with its own listen socket and connections.
+// list_mutex covers its connection table and outbound queues.
+// Reactor 0 runs on the thread that calls cmsg_server_listen_for_msgs
+struct reactor_stuff {
+  int id;
   int listen_sock;
+  int epoll_fd;
+  int wakeup_fd;
+  pthread_t thread;
+  pthread_mutex_t list_mutex;
+  struct conn_table conns;
+  struct conn_slab slab;
+  struct uring_stuff uring;
+  char *rcv_buf;
+  bool resume_check;	// a paused connection may have drained
+  bool slow_check;	// a connection's outq overflowed
+  cmsg_server_stats_t stats;
+  struct cmsg_server *srv;
+};
+
+// An event for a handler worker. data is a copy of the connection's
+// rcv_data when the event was queued
+struct handler_job {
+  struct handler_job *next;
+  struct connection *conn;
+  int action;
+  char *buf;	// msg buffer the job owns
+  bool owned;	// buf is freed after the handler, unless retained
+  size_t size;	// of buf, counted against the high water marks
+  server_rcv_msg_data_t data;
+};
+
+// Runs handlers for connections whose mailboxes have jobs. The ready
+// deque holds those connections; the worker takes from the head, and an
+// idle worker steals from the tail. mutex guards the deque
+struct handler_worker {
+  struct connection *ready_head;
+  struct connection *ready_tail;
+  bool sleeping;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  struct cmsg_server *srv;
+  cmsg_server_stats_t stats;	// handler_jobs, handler_steals
+};
+
+// A server instance. Instances share nothing, so each can run on its
+// own cores. SRV is the default instance, used by the functions that
+// do not take a cmsg_server_t
+struct cmsg_server {
+  struct sockaddr_in addr;
+  int reactor;
+  unsigned int reactor_threads;
+  unsigned int conn_pool_size;
+  unsigned int handler_threads;
+  unsigned int conn_high_water_msgs;
+  size_t conn_high_water_bytes;
+  unsigned int high_water_msgs;
+  size_t high_water_bytes;
+  size_t outq_max_bytes;
+  unsigned int outq_max_frames;
+  int outq_policy;
+  int reactor_count;
+  struct reactor_stuff *reactors;
   bool terminate_on_keypress;
+  bool zero_copy_delivery;
+  size_t stream_threshold;
+  size_t max_msg_size;
+  uint32_t features;	// offered to v2 clients
+  bool is_connected;
   bool is_listening;
+  bool stopping;	// a reactor has stopped, so the others do too
+  process_message_t handle_msg;
+  bool *terminated;
+  int worker_count;
+  struct handler_worker *workers;
+  bool workers_stopping;	// workers exit once their deques are empty
   const char *waiting_msg;
   pthread_mutex_t connect_mutex;
-  pthread_mutex_t list_mutex;
-  struct connection * connection_list;
-} SRV
- = { .port = (unsigned int) -1, .listen_sock = -1,
-     .terminate_on_keypress = true,
-     .is_listening = false,
-     .waiting_msg = "Waiting for receive. Press <Enter> to terminate.\n",
-     .connect_mutex = PTHREAD_MUTEX_INITIALIZER,
-     .list_mutex = PTHREAD_MUTEX_INITIALIZER,
-     .connection_list = NULL
-   };
+  cmsg_server_stats_t stats;	// from reactors that have shut down
+};
+
+#define SERVER_DEFAULTS \
+   { .reactor = CMSG_REACTOR_SELECT, .reactor_count = 0, .reactors = NULL, \
+     .worker_count = 0, .workers = NULL, \
+     .terminate_on_keypress = true, \
+     .is_connected = false, \
+     .is_listening = false, \
+     .stopping = false, \
+     .max_msg_size = CMSG_MAX_MSG_SIZE, \
+     .waiting_msg = "Waiting for receive. Press <Enter> to terminate.\n", \
+     .connect_mutex = PTHREAD_MUTEX_INITIALIZER \
+   }
+
+static struct cmsg_server SRV = SERVER_DEFAULTS;
+
+/*------------------------------------------------------------------
+ * buffer pool
+ *  msg buffers and outbound frames are rounded up to a power of 2
+ *  from 128 bytes to 64 KB. Each thread that allocates has a cache of
+ *  free lists, and the next allocation of a class on that thread takes
+ *  one off without a lock. A buffer goes back to the cache it came
+ *  from: freed on another thread, such as a handler worker, it is
+ *  pushed onto the cache's lock-free return list, which the owner
+ *  takes over when a free list runs dry. Bigger buffers come from
+ *  the heap.
+---------------------------------------------------------------------*/
+
+#define POOL_MIN_SHIFT 7	// 128 bytes
+#define POOL_CLASSES 10	// up to 64 KB
+#define POOL_CACHE_BYTES (256 * 1024)	// kept per class per thread
+#define POOL_HEAP_CLASS POOL_CLASSES
+
+// sits in front of every buffer
+typedef union pool_hdr {
+  struct {
+    union pool_hdr *next;	// on a free or return list
+    struct pool_cache *owner;	// the cache it is freed to
+    int size_class;
+  };
+  max_align_t align;
+} pool_hdr_t;
+
+// Caches are kept after their thread exits, on the idle list, for the
+// next new thread, since buffers freed later still point at them
+struct pool_cache {
+  pool_hdr_t *free[POOL_CLASSES];
+  unsigned count[POOL_CLASSES];
+  pool_hdr_t *returned;	// freed by other threads, newest first
+  bool idle;		// its thread has exited
+  struct pool_cache *next;	// on the idle list
+};
+
+static __thread struct pool_cache *POOL_CACHE = NULL;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_cache *pool_idle = NULL;
+static cmsg_pool_stats_t POOL_STATS;
+
+#define POOL_STAT_INC(field) \
+  __atomic_fetch_add (&POOL_STATS.field, 1, __ATOMIC_RELAXED)
+
+static inline size_t pool_class_cap (int cls)
+{
+  return POOL_CACHE_BYTES >> (POOL_MIN_SHIFT + cls);
+}
+
+// moves buffers other threads have given back onto the free lists.
+// Only the owner calls it, or the thread adopting an idle cache
+void pool_take_returned (struct pool_cache *cache)
+{
+  pool_hdr_t *hdr, *next;
+  int cls;
+
+  hdr = __atomic_exchange_n (&cache->returned, NULL, __ATOMIC_ACQUIRE);
+  for (; NULL != hdr; hdr = next) {
+    next = hdr->next;
+    cls = hdr->size_class;
+    if (cache->count[cls] >= pool_class_cap (cls)) {
+      POOL_STAT_INC (heap_frees);
+      free (hdr);
+      continue;
+    }
+    hdr->next = cache->free[cls];
+    cache->free[cls] = hdr;
+    cache->count[cls]++;
+  }
+}
+
+// gives an exiting thread's cached buffers back to the heap, and its
+// cache to the idle list
+void pool_cache_drain (void *arg)
+{
+  struct pool_cache *cache = (struct pool_cache *) arg;
+  pool_hdr_t *hdr;
+  int i;
+
+  __atomic_store_n (&cache->idle, true, __ATOMIC_SEQ_CST);
+  pool_take_returned (cache);
+  for (i=0; i<POOL_CLASSES; i++) {
+    while (NULL != (hdr = cache->free[i])) {
+      cache->free[i] = hdr->next;
+      free (hdr);
+    }
+    cache->count[i] = 0;
+  }
+  pthread_mutex_lock (&pool_idle_mutex);
+  LL_PREPEND (pool_idle, cache);
+  pthread_mutex_unlock (&pool_idle_mutex);
+}
+
+void pool_make_key (void)
+{
+  pthread_key_create (&pool_key, pool_cache_drain);
+}
+
+// the calling thread's cache, set up on its first allocation.
+// NULL if there is no memory for one
+struct pool_cache *pool_cache_get (void)
+{
+  struct pool_cache *cache = POOL_CACHE;
+
+  if (NULL != cache)
+    return cache;
+  pthread_once (&pool_key_once, pool_make_key);
+  pthread_mutex_lock (&pool_idle_mutex);
+  cache = pool_idle;
+  if (NULL != cache)
+    LL_DELETE (pool_idle, cache);
+  pthread_mutex_unlock (&pool_idle_mutex);
+  if (NULL == cache) {
+    cache = (struct pool_cache *) calloc (1, sizeof (struct pool_cache));
+    if (NULL == cache)
+      return NULL;
+  }
+  __atomic_store_n (&cache->idle, false, __ATOMIC_SEQ_CST);
+  // frees that raced with its last thread exiting
+  pool_take_returned (cache);
+  pthread_setspecific (pool_key, cache);
+  POOL_CACHE = cache;
+  return cache;
+}
+
+int pool_size_class (size_t size)
+{
+  int i;
+
+  for (i=0; i<POOL_CLASSES; i++)
+    if (size <= ((size_t) 1 << (POOL_MIN_SHIFT + i)))
+      return i;
+  return POOL_HEAP_CLASS;
+}
+
+void *pool_alloc (size_t size)
+{
+  int cls = pool_size_class (size);
+  struct pool_cache *cache = NULL;
+  pool_hdr_t *hdr = NULL;
+
+  if (cls != POOL_HEAP_CLASS)
+    cache = pool_cache_get ();
+  if (NULL == cache)
+    cls = POOL_HEAP_CLASS;
+  else {
+    hdr = cache->free[cls];
+    if ((NULL == hdr) && 
+        (NULL != __atomic_load_n (&cache->returned, __ATOMIC_RELAXED))) {
+      pool_take_returned (cache);
+      hdr = cache->free[cls];
+    }
+    if (NULL != hdr) {
+      cache->free[cls] = hdr->next;
+      cache->count[cls]--;
+      POOL_STAT_INC (hits);
+    } else
+      size = (size_t) 1 << (POOL_MIN_SHIFT + cls);
+  }
+  if (NULL == hdr) {
+    POOL_STAT_INC (misses);
+    hdr = (pool_hdr_t *) malloc (sizeof (pool_hdr_t) + size);
+    if (NULL == hdr)
+      return NULL;
+  }
+  hdr->size_class = cls;
+  hdr->owner = cache;
+  return hdr + 1;
+}
+
+void pool_free (void *ptr)
+{
+  struct pool_cache *cache;
+  pool_hdr_t *hdr;
+  int cls;
+
+  if (NULL == ptr)
+    return;
+  hdr = (pool_hdr_t *) ptr - 1;
+  cls = hdr->size_class;
+  cache = hdr->owner;
+  if (cls == POOL_HEAP_CLASS) {
+    POOL_STAT_INC (heap_frees);
+    free (hdr);
+    return;
+  }
+  if (cache != POOL_CACHE) {
+    if (__atomic_load_n (&cache->idle, __ATOMIC_ACQUIRE)) {
+      POOL_STAT_INC (heap_frees);
+      free (hdr);
+      return;
+    }
+    POOL_STAT_INC (remote_frees);
+    hdr->next = __atomic_load_n (&cache->returned, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&cache->returned, &hdr->next, hdr,
+	     true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+    return;
+  }
+  if (cache->count[cls] >= pool_class_cap (cls)) {
+    POOL_STAT_INC (heap_frees);
+    free (hdr);
+    return;
+  }
+  hdr->next = cache->free[cls];
+  cache->free[cls] = hdr;
+  cache->count[cls]++;
+}
+
+void cmsg_msg_free (char *msg)
+{
+  pool_free (msg);
+}
+
+void cmsg_pool_get_stats (cmsg_pool_stats_t *stats)
+{
+  stats->hits = __atomic_load_n (&POOL_STATS.hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n (&POOL_STATS.misses, __ATOMIC_RELAXED);
+  stats->heap_frees = __atomic_load_n (&POOL_STATS.heap_frees, __ATOMIC_RELAXED);
+  stats->remote_frees = __atomic_load_n (&POOL_STATS.remote_frees, 
+    __ATOMIC_RELAXED);
+}
 
 
 
 void init_connection (struct connection *conn)
 {
   conn->rcv_data.sock = -1;
+  conn->rcv_data.handle = 0;
+  conn->rcv_data.user_data = NULL;
+  conn->rcv_data.msg_type = 0;
+  conn->rcv_data.stream_msg_size = 0;
+  conn->rcv_data.stream_pos = 0;
+  conn->rcv_data.protocol = CMSG_PROTOCOL_V1;
+  conn->rcv_data.features = 0;
+  conn->rcv_flags = 0;
   conn->oserr = 0;
   conn->rcv_state = -1;
   conn->rcv_selected = false;
+  conn->snd_selected = false;
+  conn->want_write = false;
+  conn->send_inflight = false;
+  conn->outq_head = NULL;
+  conn->outq_tail = NULL;
+  conn->outq_bytes = 0;
+  conn->outq_frames = 0;
+  conn->inflight_frames = 0;
+  conn->outq_overflowed = false;
+  conn->slow_pending = false;
+  conn->outq_evict = false;
+  conn->rcv_header_len = 0;
+  conn->rcv_tmp = NULL;
+  conn->uring_pending = 0;
+  conn->rs = NULL;
+  conn->worker = NULL;
+  conn->refs = 1;
+  conn->mailbox = NULL;
+  conn->scheduled = false;
+  conn->ready_prev = NULL;
+  conn->ready_next = NULL;
+  conn->queued_msgs = 0;
+  conn->queued_bytes = 0;
+  conn->rd_paused = false;
+  conn->recv_stopped = false;
+  conn->held_head = -1;
+  conn->held_tail = -1;
+  conn->removed = false;
+  conn->rcv_data.reactor_id = 0;
+  conn->rcv_data.server = NULL;
   conn->rcv_data.rcv_msg_size = 0;
   conn->rcv_end_pos = 0;
   conn->rcv_data.rcv_msg = NULL;
+  conn->prev = NULL;
   conn->next = NULL;
 }
 
@@ -77,80 +558,591 @@ void init_client_conn (struct client_conn *conn)
   conn->rcv_msg = NULL;
   conn->rcv_msg_size = 0;
   conn->rcv_count = 0;
+  conn->rcv_msg_type = 0;
+  conn->protocol = CMSG_PROTOCOL_V1;
+  conn->features = 0;
   conn->terminated = false;
+  conn->wakeup_fd = -1;
+  conn->sendq = NULL;
+  conn->combining = false;
+  conn->send_err = 0;
+  conn->coalesce_buf = NULL;
+  conn->coalesce_size = 0;
+  conn->coalesce_len = 0;
+  conn->flush_usecs = 0;
+  conn->flush_deadline = 0;
+  conn->flush_queued = false;
+  conn->flush_prev = NULL;
+  conn->flush_next = NULL;
+  conn->rcv_buf = NULL;
+  conn->rcv_buf_size = 0;
+  conn->rcv_head = 0;
+  conn->rcv_tail = 0;
+  conn->max_msg_size = CMSG_MAX_MSG_SIZE;
+  conn->rcv_wait_msecs = -1;
   pthread_mutex_init (&conn->send_mutex, NULL);
   pthread_mutex_init (&conn->rcv_mutex, NULL);
 }
 
 
-int wait_server_ready (bool *terminated)
+// true once the application sets *terminated, or another reactor
+// has stopped
+bool reactor_stopped (struct reactor_stuff *rs, bool *terminated)
+{
+  if ((NULL != terminated) && *terminated)
+    return true;
+  return __atomic_load_n (&rs->srv->stopping, __ATOMIC_ACQUIRE);
+}
+
+// only reactor 0 watches stdin and prints the waiting msg
+#define WATCH_KEYPRESS(rs) \
+  ((rs)->srv->terminate_on_keypress && ((rs)->id == 0))
+#define WAITING_MSG(rs) (((rs)->id == 0) ? (rs)->srv->waiting_msg : NULL)
+
+// A reactor only needs a timeout to look at *terminated, which nothing
+// signals. Otherwise it sleeps until an fd is ready or it is woken, so
+// an idle server costs no wakeups
+#define REACTOR_POLL_MSECS 500
+
+int reactor_wait_msecs (bool *terminated)
+{
+  if (NULL != terminated)
+    return REACTOR_POLL_MSECS;
+  return -1;
+}
+
+int wait_server_ready (struct reactor_stuff *rs, bool *terminated)
 {
   struct timeval timeout;
+  struct timeval *timeout_ptr = NULL;
   struct connection *conn;
   int i, rtn, sock, highest_sock;
-  int fd = SRV.listen_sock;
-  int timeout_count = 0;
+  int wait_msecs = reactor_wait_msecs (terminated);
+  uint64_t wakeups;
   fd_set fds;
+  fd_set wfds;
 
   highest_sock = -1;
 
   while (1)
   {
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 500000;
+    if (wait_msecs >= 0) {
+      timeout.tv_sec = wait_msecs / 1000;
+      timeout.tv_usec = (wait_msecs % 1000) * 1000;
+      timeout_ptr = &timeout;
+    }
     FD_ZERO (&fds);
-    if (SRV.listen_sock != -1) {
-      FD_SET (SRV.listen_sock, &fds);
-      highest_sock = SRV.listen_sock;
+    FD_ZERO (&wfds);
+    if (rs->listen_sock != -1) {
+      FD_SET (rs->listen_sock, &fds);
+      highest_sock = rs->listen_sock;
       // printf ("Waiting on listener %d\n", listen_sock);
     }
-    LL_FOREACH (SRV.connection_list, conn) {
+    FD_SET (rs->wakeup_fd, &fds);
+    if (rs->wakeup_fd > highest_sock)
+      highest_sock = rs->wakeup_fd;
+    pthread_mutex_lock (&rs->list_mutex);
+    CONN_TABLE_FOREACH (rs->conns, i, conn) {
       conn->rcv_selected = false;
+      conn->snd_selected = false;
       if (conn->rcv_state >= 0) {
         sock = conn->rcv_data.sock;
         // printf ("Waiting on %d\n", sock);
         if (sock > highest_sock)
           highest_sock = sock;
-        FD_SET (sock, &fds);
+        if (!conn->rd_paused)
+          FD_SET (sock, &fds);
+        if (NULL != conn->outq_head)
+          FD_SET (sock, &wfds);
       }
     }
-    if (SRV.terminate_on_keypress) {
+    pthread_mutex_unlock (&rs->list_mutex);
+    if (WATCH_KEYPRESS (rs)) {
       FD_SET (STDIN_FILENO, &fds);
     }
-    rtn = select (highest_sock+1, &fds, NULL, NULL, &timeout);
+    rtn = select (highest_sock+1, &fds, &wfds, NULL, timeout_ptr);
+    STAT_INC (rs, wait_calls);
     if (rtn < 0) {
       printf ("Error on select for receive\n");
       return -1;
     }
     if (rtn != 0)
       break;
-    if (NULL != terminated)
-      if (*terminated)
-        break;
-    if (NULL != SRV.waiting_msg) {
-      ++timeout_count;
-      if ((timeout_count & 3) == 0)
-        printf (SRV.waiting_msg);
-    }
+    if (reactor_stopped (rs, terminated))
+      break;
   }
   rtn = 0;
-  if (SRV.listen_sock != -1)
-    if (FD_ISSET (SRV.listen_sock, &fds))
+  if (rs->listen_sock != -1)
+    if (FD_ISSET (rs->listen_sock, &fds))
       rtn = 1;
-  LL_FOREACH (SRV.connection_list, conn) {
-    if (conn->rcv_state >= 0)
+  // a sender queued data. the write set is rebuilt on the next pass
+  if (FD_ISSET (rs->wakeup_fd, &fds))
+    read (rs->wakeup_fd, &wakeups, sizeof (wakeups));
+  CONN_TABLE_FOREACH (rs->conns, i, conn) {
+    if (conn->rcv_state >= 0) {
       if (FD_ISSET (conn->rcv_data.sock, &fds)) {
         conn->rcv_selected = true;
         rtn |= 2;
       }
+      if (FD_ISSET (conn->rcv_data.sock, &wfds)) {
+        conn->snd_selected = true;
+        rtn |= 2;
+      }
+    }
   }
-  if (SRV.terminate_on_keypress) {
+  if (WATCH_KEYPRESS (rs)) {
     if (FD_ISSET (STDIN_FILENO, &fds))
       rtn |= 4;
   }
   return rtn;
 }
 
+// epoll_event.data.ptr tags for the non-connection fds.
+// Every other registered fd carries its struct connection *.
+#define EPOLL_LISTEN_TAG(rs) ((void *) &(rs)->listen_sock)
+#define EPOLL_STDIN_TAG ((void *) &SRV.terminate_on_keypress)
+#define EPOLL_WAKEUP_TAG(rs) ((void *) &(rs)->wakeup_fd)
+
+int epoll_add (struct reactor_stuff *rs, void *ptr, int sock)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = ptr;
+  if (epoll_ctl (rs->epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+    dbg_err (errno, "Unable to add socket %d to epoll set\n", sock);
+    return -1;
+  }
+  return 0;
+}
+
+// returns number of ready events, 0 if terminated, -1 on error
+int wait_server_ready_epoll (struct reactor_stuff *rs, 
+  struct epoll_event *events, bool *terminated)
+{
+  int rtn;
+  int wait_msecs = reactor_wait_msecs (terminated);
+
+  while (1)
+  {
+    rtn = epoll_wait (rs->epoll_fd, events, EPOLL_MAX_EVENTS, wait_msecs);
+    STAT_INC (rs, wait_calls);
+    if (rtn < 0) {
+      if (errno == EINTR)
+        continue;
+      dbg_err (errno, "Error on epoll_wait for receive\n");
+      return -1;
+    }
+    if (rtn != 0)
+      return rtn;
+    if (reactor_stopped (rs, terminated))
+      return 0;
+  }
+}
+
+/*------------------------------------------------------------------
+ * io_uring reactor
+ *  multishot accept on the listen socket, multishot recv on each
+ *  connection into a ring of provided buffers, and sends queued as
+ *  SQEs that reach the kernel together on the next io_uring_enter.
+---------------------------------------------------------------------*/
+
+// low bits of the sqe user_data tell what kind of request completed
+#define URING_TAG_RECV 0	// struct connection *
+#define URING_TAG_SEND 1	// struct uring_send *
+#define URING_TAG_ACCEPT 2
+#define URING_TAG_STDIN 3
+#define URING_TAG_NOP 4	// wakeups and cancels, nothing to handle
+#define URING_TAG_MASK 7
+
+// one sendmsg in flight per connection, over the head of its outq
+typedef struct uring_send {
+  struct connection *conn;
+  struct msghdr mh;
+  struct iovec vec[];
+} uring_send_t;
+
+void put_be32 (unsigned char *buf, uint32_t n)
+{
+  buf[0] = (unsigned char) (n >> 24);
+  buf[1] = (unsigned char) (n >> 16);
+  buf[2] = (unsigned char) (n >> 8);
+  buf[3] = (unsigned char) n;
+}
+
+uint32_t get_be32 (const unsigned char *buf)
+{
+  return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+    ((uint32_t) buf[2] << 8) | (uint32_t) buf[3];
+}
+
+// returns the header size
+size_t make_msg_header (unsigned char *header, int protocol, int flags,
+  int msg_type, size_t sz_msg)
+{
+  if (protocol == CMSG_PROTOCOL_V1) {
+    header[0] = MSG_HEADER_MARK;
+    header[1] = MSG_HEADER_MARK;
+    header[2] = sz_msg / 256;
+    header[3] = sz_msg % 256;
+    return MSG_HEADER_SIZE_V1;
+  }
+  header[0] = MSG_HEADER_MARK_V2;
+  header[1] = MSG_HEADER_MARK_V2;
+  header[2] = (unsigned char) flags;
+  header[3] = (unsigned char) msg_type;
+  put_be32 (header+4, (uint32_t) sz_msg);
+  return MSG_HEADER_SIZE_V2;
+}
+
+// returns 0, or the errno for a msg that cannot be framed
+int check_msg_size (int protocol, int msg_type, size_t sz_msg)
+{
+  if ((msg_type < 0) || (msg_type > 255))
+    return EINVAL;
+  if (protocol == CMSG_PROTOCOL_V2)
+    return (sz_msg > UINT32_MAX) ? EMSGSIZE : 0;
+  if (msg_type != 0)
+    return EPROTO;
+  return (sz_msg > CMSG_V1_MAX_MSG_SIZE) ? EMSGSIZE : 0;
+}
+
+size_t iov_total (const struct iovec *iov, int iovcnt)
+{
+  size_t total = 0;
+  int i;
+
+  for (i=0; i<iovcnt; i++)
+    total += iov[i].iov_len;
+  return total;
+}
+
+int uring_enter (struct reactor_stuff *rs, unsigned to_submit, 
+  unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+  STAT_INC (rs, uring_enter_calls);
+  return (int) syscall (__NR_io_uring_enter, rs->uring.fd, to_submit,
+    min_complete, flags, arg, argsz);
+}
+
+// sqes queued but not yet consumed by the kernel. io_uring_enter
+// skips the wait if it is asked to submit more than are queued
+unsigned uring_sq_pending (struct reactor_stuff *rs)
+{
+  return __atomic_load_n (rs->uring.sq_tail, __ATOMIC_ACQUIRE) -
+    __atomic_load_n (rs->uring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+void uring_teardown (struct reactor_stuff *rs)
+{
+  struct uring_stuff *ur = &rs->uring;
+
+  if (ur->fd != -1)
+    close (ur->fd);
+  if (NULL != ur->sqes)
+    munmap (ur->sqes, ur->sqes_size);
+  if ((NULL != ur->cq_ring) && (ur->cq_ring != ur->sq_ring))
+    munmap (ur->cq_ring, ur->cq_ring_size);
+  if (NULL != ur->sq_ring)
+    munmap (ur->sq_ring, ur->sq_ring_size);
+  if (NULL != ur->buf_ring)
+    munmap (ur->buf_ring, ur->buf_ring_size);
+  free (ur->bufs);
+  ur->fd = -1;
+  ur->sqes = NULL;
+  ur->sq_ring = ur->cq_ring = NULL;
+  ur->buf_ring = NULL;
+  ur->bufs = NULL;
+}
+
+// hands buffer bid back to the kernel. visible after uring_publish_bufs
+void uring_recycle_buf (struct reactor_stuff *rs, unsigned short bid)
+{
+  struct uring_stuff *ur = &rs->uring;
+  struct io_uring_buf *buf;
+
+  buf = &ur->buf_ring->bufs[ur->buf_tail & (URING_BUF_COUNT - 1)];
+  buf->addr = (unsigned long) (ur->bufs + (size_t) bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  ur->buf_tail++;
+}
+
+void uring_publish_bufs (struct reactor_stuff *rs)
+{
+  __atomic_store_n (&rs->uring.buf_ring->tail, rs->uring.buf_tail,
+    __ATOMIC_RELEASE);
+}
+
+// returns 0 or an errno
+int uring_setup (struct reactor_stuff *rs)
+{
+  struct uring_stuff *ur = &rs->uring;
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  unsigned i;
+  int rtn;
+
+  memset (&params, 0, sizeof (params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = URING_CQ_ENTRIES;
+  ur->fd = (int) syscall (__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+  if (ur->fd < 0) {
+    rtn = errno;
+    dbg_err (errno, "Unable to set up io_uring\n");
+    ur->fd = -1;
+    return rtn;
+  }
+  if (!(params.features & IORING_FEAT_EXT_ARG)) {
+    printf ("io_uring reactor needs a newer kernel\n");
+    uring_teardown (rs);
+    return ENOSYS;
+  }
+  ur->sq_entries = params.sq_entries;
+  ur->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  ur->cq_ring_size = params.cq_off.cqes + 
+    params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ur->cq_ring_size > ur->sq_ring_size)
+      ur->sq_ring_size = ur->cq_ring_size;
+    ur->cq_ring_size = ur->sq_ring_size;
+  }
+  ur->sq_ring = mmap (NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+  if (ur->sq_ring == MAP_FAILED) {
+    ur->sq_ring = NULL;
+    goto map_error;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ur->cq_ring = ur->sq_ring;
+  else {
+    ur->cq_ring = mmap (NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+    if (ur->cq_ring == MAP_FAILED) {
+      ur->cq_ring = NULL;
+      goto map_error;
+    }
+  }
+  ur->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  ur->sqes = mmap (NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+  if (ur->sqes == MAP_FAILED) {
+    ur->sqes = NULL;
+    goto map_error;
+  }
+  ur->sq_head = (unsigned *) ((char *) ur->sq_ring + params.sq_off.head);
+  ur->sq_tail = (unsigned *) ((char *) ur->sq_ring + params.sq_off.tail);
+  ur->sq_mask = (unsigned *) ((char *) ur->sq_ring + params.sq_off.ring_mask);
+  ur->sq_array = (unsigned *) ((char *) ur->sq_ring + params.sq_off.array);
+  ur->cq_head = (unsigned *) ((char *) ur->cq_ring + params.cq_off.head);
+  ur->cq_tail = (unsigned *) ((char *) ur->cq_ring + params.cq_off.tail);
+  ur->cq_mask = (unsigned *) ((char *) ur->cq_ring + params.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *) ((char *) ur->cq_ring + params.cq_off.cqes);
+  // sqe slot i is always submitted through array entry i
+  for (i=0; i<params.sq_entries; i++)
+    ur->sq_array[i] = i;
+
+  ur->buf_ring_size = URING_BUF_COUNT * sizeof (struct io_uring_buf);
+  ur->buf_ring = mmap (NULL, ur->buf_ring_size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ur->buf_ring == MAP_FAILED) {
+    ur->buf_ring = NULL;
+    goto map_error;
+  }
+  ur->bufs = (char *) malloc ((size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+  if (NULL == ur->bufs) {
+    printf ("Unable to malloc io_uring receive buffers\n");
+    uring_teardown (rs);
+    return ENOMEM;
+  }
+  memset (&reg, 0, sizeof (reg));
+  reg.ring_addr = (unsigned long) ur->buf_ring;
+  reg.ring_entries = URING_BUF_COUNT;
+  reg.bgid = URING_BUF_GROUP;
+  if (syscall (__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING,
+	&reg, 1) < 0) {
+    rtn = errno;
+    dbg_err (errno, "Unable to register io_uring buffer ring\n");
+    uring_teardown (rs);
+    return rtn;
+  }
+  ur->buf_tail = 0;
+  for (i=0; i<URING_BUF_COUNT; i++)
+    uring_recycle_buf (rs, (unsigned short) i);
+  uring_publish_bufs (rs);
+  ur->closing_list = NULL;
+  return 0;
+
+map_error:
+  rtn = errno;
+  dbg_err (errno, "Unable to map io_uring rings\n");
+  uring_teardown (rs);
+  return rtn;
+}
+
+// sq_mutex must be held. flushes the queue to the kernel if it is full
+struct io_uring_sqe *uring_get_sqe (struct reactor_stuff *rs)
+{
+  struct uring_stuff *ur = &rs->uring;
+  unsigned tail = *ur->sq_tail;
+  struct io_uring_sqe *sqe;
+
+  if (tail - __atomic_load_n (ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries) {
+    uring_enter (rs, uring_sq_pending (rs), 0, 0, NULL, 0);
+    if (tail - __atomic_load_n (ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries) {
+      printf ("io_uring submission queue full\n");
+      return NULL;
+    }
+  }
+  sqe = &ur->sqes[tail & *ur->sq_mask];
+  memset (sqe, 0, sizeof (*sqe));
+  return sqe;
+}
+
+// sq_mutex must be held
+void uring_commit_sqe (struct reactor_stuff *rs)
+{
+  __atomic_store_n (rs->uring.sq_tail, *rs->uring.sq_tail + 1,
+    __ATOMIC_RELEASE);
+}
+
+int uring_queue (struct reactor_stuff *rs, unsigned char opcode, int fd,
+  void *addr, unsigned len,  unsigned long user_data)
+{
+  struct io_uring_sqe *sqe;
+
+  pthread_mutex_lock (&rs->uring.sq_mutex);
+  sqe = uring_get_sqe (rs);
+  if (NULL == sqe) {
+    pthread_mutex_unlock (&rs->uring.sq_mutex);
+    return -1;
+  }
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) addr;
+  sqe->len = len;
+  sqe->user_data = user_data;
+  switch (opcode) {
+    case IORING_OP_ACCEPT:
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      break;
+    case IORING_OP_RECV:
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = URING_BUF_GROUP;
+      break;
+    case IORING_OP_SENDMSG:
+      sqe->msg_flags = MSG_NOSIGNAL;
+      break;
+    case IORING_OP_POLL_ADD:
+      sqe->poll32_events = POLLIN;
+      break;
+  }
+  uring_commit_sqe (rs);
+  pthread_mutex_unlock (&rs->uring.sq_mutex);
+  return 0;
+}
+
+// list_mutex must be held. makes room for sockets below min_size
+int conn_table_reserve (struct conn_table *table, int min_size)
+{
+  int new_size;
+  struct connection **new_slots;
+  uint32_t *new_gens;
+
+  if (min_size <= table->size)
+    return 0;
+  new_size = (table->size == 0) ? 1024 : table->size;
+  while (new_size < min_size)
+    new_size *= 2;
+  new_slots = (struct connection **) realloc (table->slots, 
+    new_size * sizeof (struct connection *));
+  if (NULL == new_slots) {
+    printf ("Unable to expand connection table to %d\n", new_size);
+    return -1;
+  }
+  memset (new_slots + table->size, 0, 
+    (new_size - table->size) * sizeof (struct connection *));
+  table->slots = new_slots;
+  new_gens = (uint32_t *) realloc (table->gens, 
+    new_size * sizeof (uint32_t));
+  if (NULL == new_gens) {
+    printf ("Unable to expand connection table to %d\n", new_size);
+    return -1;
+  }
+  memset (new_gens + table->size, 0, 
+    (new_size - table->size) * sizeof (uint32_t));
+  table->gens = new_gens;
+  table->size = new_size;
+  return 0;
+}
+
+// returns 0 or an errno
+int conn_slab_setup (struct conn_slab *slab, unsigned int count)
+{
+  unsigned int i;
+
+  slab->size = (size_t) count * sizeof (struct connection);
+  slab->conns = (struct connection *) mmap (NULL, slab->size, 
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (slab->conns == MAP_FAILED) {
+    dbg_err (errno, "Unable to map connection pool\n");
+    slab->conns = NULL;
+    return ENOMEM;
+  }
+  slab->count = count;
+  slab->free_list = NULL;
+  for (i=count; i>0; i--) {
+    slab->conns[i-1].next = slab->free_list;
+    slab->free_list = &slab->conns[i-1];
+  }
+  return 0;
+}
+
+void conn_slab_teardown (struct conn_slab *slab)
+{
+  if (NULL != slab->conns)
+    munmap (slab->conns, slab->size);
+  slab->conns = NULL;
+  slab->count = 0;
+  slab->free_list = NULL;
+}
+
+struct connection *conn_alloc (struct reactor_stuff *rs)
+{
+  struct connection *conn;
+
+  pthread_mutex_lock (&rs->slab.mutex);
+  conn = rs->slab.free_list;
+  if (NULL != conn)
+    rs->slab.free_list = conn->next;
+  pthread_mutex_unlock (&rs->slab.mutex);
+  if (NULL != conn)
+    return conn;
+  STAT_INC (rs, conn_heap_allocs);
+  return (struct connection *) malloc (sizeof (struct connection));
+}
+
+void conn_free (struct reactor_stuff *rs, struct connection *conn)
+{
+  struct conn_slab *slab = &rs->slab;
+
+  if ((conn >= slab->conns) && (conn < slab->conns + slab->count)) {
+    pthread_mutex_lock (&slab->mutex);
+    conn->next = slab->free_list;
+    slab->free_list = conn;
+    pthread_mutex_unlock (&slab->mutex);
+  } else
+    free (conn);
+}
+
+// drops a reference. The last one frees the connection
+void conn_put (struct connection *conn)
+{
+  if (__atomic_sub_fetch (&conn->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    conn_free (conn->rs, conn);
+}
+
 int make_sockaddr (struct sockaddr_in *addr, 
   const char *ip_addr, unsigned int port, bool rcv_any)
 {
@@ -172,38 +1164,30 @@ int make_sockaddr (struct sockaddr_in *addr,
   return 0;
 }
 
-int cmsg_connect_server (const char *ip_addr, unsigned int port,
-  server_opts_t *options)
+void reactor_teardown (struct reactor_stuff *rs);
+
+// sets up reactor id with its own listen socket, bound to srv->addr
+// returns 0 or an errno
+int reactor_setup (struct cmsg_server *srv, struct reactor_stuff *rs, int id,
+  unsigned int pool_size)
 {
 	int sock, flags, rtn;
 	int reuse_opt = 1;
 
-	pthread_mutex_lock (&SRV.connect_mutex);
-	if (SRV.listen_sock != -1) {
-	  printf ("server already connected\n");
-	  pthread_mutex_unlock (&SRV.connect_mutex);
-	  return EALREADY;
-	}
-	if (NULL != options) {
-		SRV.terminate_on_keypress = options->terminate_on_keypress;
-		SRV.waiting_msg = options->waiting_msg;
-	}
-
-	if ((NULL == ip_addr) || ((unsigned int) -1 == port)) {
-		SRV.listen_sock = -1;
-		printf ("Invalid ip addr or port for cmsg_server_connect\n");
-		pthread_mutex_unlock (&SRV.connect_mutex);
-		return EINVAL;
-	}
+	memset (rs, 0, sizeof (*rs));
+	rs->id = id;
+	rs->srv = srv;
+	rs->listen_sock = -1;
+	rs->epoll_fd = -1;
+	rs->wakeup_fd = -1;
+	rs->uring.fd = -1;
+	pthread_mutex_init (&rs->list_mutex, NULL);
+	pthread_mutex_init (&rs->slab.mutex, NULL);
+	pthread_mutex_init (&rs->uring.sq_mutex, NULL);
 
-	if (make_sockaddr (&SRV.addr, ip_addr, port, false) != 0) {
-	  pthread_mutex_unlock (&SRV.connect_mutex);
-          return EINVAL;
-	}
 	sock = socket (AF_INET, SOCK_STREAM, 0);
 	if (sock < 0) {
 		dbg_err (errno, "Unable to create rcv socket\n");
-		pthread_mutex_unlock (&SRV.connect_mutex);
  		return errno;
 	}
 #if 0
@@ -220,40 +1204,748 @@ int cmsg_connect_server (const char *ip_addr, unsigned int port,
  		return -1;
 	}
 #endif
-	if (bind (sock, (struct sockaddr *) &SRV.addr, 
+	// each reactor binds the same port. The kernel spreads
+	// incoming connections across the listen sockets
+	if (srv->reactor_count > 1)
+	  if (setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, 
+	      &reuse_opt, sizeof (reuse_opt)) < 0) {
+	    dbg_err (errno, "Unable to set SO_REUSEPORT on receive socket\n");
+	    rtn = errno;
+	    close (sock);
+	    return rtn;
+	  }
+	if (bind (sock, (struct sockaddr *) &srv->addr, 
           sizeof (struct sockaddr_in)) < 0) {
 		dbg_err (errno, "Unable to bind to receive socket %s\n");
 		rtn = errno;
 		close (sock);
-		pthread_mutex_unlock (&SRV.connect_mutex);
 		return rtn;
 	}
-	if (listen (sock, 50) == -1) {
+	if (listen (sock, 
+	    (srv->reactor == CMSG_REACTOR_SELECT) ? 50 : SOMAXCONN) == -1) {
 	  dbg_err (errno, "Listen error on receive socket: %s\n");
 	  rtn = errno;
 	  close (sock);
-	  pthread_mutex_unlock (&SRV.connect_mutex);
 	  return rtn;
 	}
-	SRV.listen_sock = sock;
-	pthread_mutex_unlock (&SRV.connect_mutex);
-	return 0;
-}
-
-int server_accept (process_message_t handle_msg)
-{
+	rs->listen_sock = sock;
+	if (srv->reactor == CMSG_REACTOR_EPOLL) {
+	  // non-blocking so a burst of accepts can be drained per wakeup
+	  flags = fcntl (sock, F_GETFL);
+	  if ((flags == -1) || (fcntl (sock, F_SETFL, flags | O_NONBLOCK) == -1)) {
+	    dbg_err (errno, "Unable to set listen socket flags: \n");
+	    rtn = errno;
+	    reactor_teardown (rs);
+	    return rtn;
+	  }
+	  rs->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+	  if (rs->epoll_fd < 0) {
+	    dbg_err (errno, "Unable to create epoll instance\n");
+	    rtn = errno;
+	    reactor_teardown (rs);
+	    return rtn;
+	  }
+	  if (epoll_add (rs, EPOLL_LISTEN_TAG (rs), sock) != 0) {
+	    rtn = errno;
+	    reactor_teardown (rs);
+	    return rtn;
+	  }
+	  // stdin that is a regular file or /dev/null cannot be polled
+	  if (WATCH_KEYPRESS (rs))
+	    epoll_add (rs, EPOLL_STDIN_TAG, STDIN_FILENO);
+	}
+	if (srv->reactor == CMSG_REACTOR_IO_URING) {
+	  rtn = uring_setup (rs);
+	  if (rtn != 0) {
+	    reactor_teardown (rs);
+	    return rtn;
+	  }
+	} else {
+	  rs->wakeup_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	  if (rs->wakeup_fd < 0) {
+	    dbg_err (errno, "Unable to create wakeup eventfd\n");
+	    rtn = errno;
+	    reactor_teardown (rs);
+	    return rtn;
+	  }
+	  if ((srv->reactor == CMSG_REACTOR_EPOLL) &&
+	      (epoll_add (rs, EPOLL_WAKEUP_TAG (rs), rs->wakeup_fd) != 0)) {
+	    rtn = errno;
+	    reactor_teardown (rs);
+	    return rtn;
+	  }
+	  rs->rcv_buf = (char *) malloc (CMSG_RCV_BUF_SIZE);
+	  if (NULL == rs->rcv_buf) {
+	    printf ("Unable to malloc server read buffer\n");
+	    reactor_teardown (rs);
+	    return ENOMEM;
+	  }
+	}
+	if (pool_size != 0) {
+	  // the pool is only an optimization. Without it accepts use the heap
+	  if (conn_slab_setup (&rs->slab, pool_size) == 0) {
+	    pthread_mutex_lock (&rs->list_mutex);
+	    conn_table_reserve (&rs->conns, sock + 1 + (int) pool_size);
+	    pthread_mutex_unlock (&rs->list_mutex);
+	  }
+	}
+	return 0;
+}
+
+void server_set_opts (struct cmsg_server *srv, server_opts_t *options)
+{
+	srv->terminate_on_keypress = options->terminate_on_keypress;
+	srv->waiting_msg = options->waiting_msg;
+	srv->reactor = options->reactor;
+	srv->zero_copy_delivery = options->zero_copy_delivery;
+	srv->features = options->features;
+	srv->stream_threshold = options->stream_threshold;
+	srv->max_msg_size = (options->max_msg_size != 0) ? 
+	  options->max_msg_size : CMSG_MAX_MSG_SIZE;
+	srv->reactor_threads = options->reactor_threads;
+	srv->conn_pool_size = options->conn_pool_size;
+	srv->handler_threads = options->handler_threads;
+	srv->conn_high_water_msgs = options->conn_high_water_msgs;
+	srv->conn_high_water_bytes = options->conn_high_water_bytes;
+	srv->high_water_msgs = options->high_water_msgs;
+	srv->high_water_bytes = options->high_water_bytes;
+	srv->outq_max_bytes = options->outq_max_bytes;
+	srv->outq_max_frames = options->outq_max_frames;
+	srv->outq_policy = options->outq_policy;
+}
+
+// options may be NULL to keep those the server has
+int server_connect (struct cmsg_server *srv, const char *ip_addr,
+  unsigned int port, server_opts_t *options)
+{
+	int i, rtn;
+	unsigned int pool_size;
+
+	pthread_mutex_lock (&srv->connect_mutex);
+	if (srv->is_connected) {
+	  printf ("server already connected\n");
+	  pthread_mutex_unlock (&srv->connect_mutex);
+	  return EALREADY;
+	}
+	if (NULL != options)
+		server_set_opts (srv, options);
+	if ((srv->reactor != CMSG_REACTOR_SELECT) &&
+	    (srv->reactor != CMSG_REACTOR_EPOLL) &&
+	    (srv->reactor != CMSG_REACTOR_IO_URING)) {
+		printf ("Invalid reactor %d for cmsg_server_connect\n", srv->reactor);
+		pthread_mutex_unlock (&srv->connect_mutex);
+		return EINVAL;
+	}
+	if (srv->reactor_threads > MAX_REACTOR_THREADS) {
+		printf ("Invalid reactor_threads %u for cmsg_server_connect\n",
+		  srv->reactor_threads);
+		pthread_mutex_unlock (&srv->connect_mutex);
+		return EINVAL;
+	}
+
+	if ((NULL == ip_addr) || ((unsigned int) -1 == port)) {
+		printf ("Invalid ip addr or port for cmsg_server_connect\n");
+		pthread_mutex_unlock (&srv->connect_mutex);
+		return EINVAL;
+	}
+
+	if (make_sockaddr (&srv->addr, ip_addr, port, false) != 0) {
+	  pthread_mutex_unlock (&srv->connect_mutex);
+          return EINVAL;
+	}
+	// left from an earlier server, which has shut down
+	free (srv->reactors);
+	srv->reactor_count = (srv->reactor_threads > 1) ? 
+	  (int) srv->reactor_threads : 1;
+	srv->reactors = (struct reactor_stuff *) calloc (srv->reactor_count,
+	  sizeof (struct reactor_stuff));
+	if (NULL == srv->reactors) {
+	  printf ("Unable to malloc %d reactors\n", srv->reactor_count);
+	  srv->reactor_count = 0;
+	  pthread_mutex_unlock (&srv->connect_mutex);
+	  return ENOMEM;
+	}
+	// the connection pool is split evenly across the reactors
+	pool_size = (srv->conn_pool_size + srv->reactor_count - 1) / 
+	  srv->reactor_count;
+	for (i=0; i<srv->reactor_count; i++) {
+	  rtn = reactor_setup (srv, &srv->reactors[i], i, pool_size);
+	  if (rtn != 0) {
+	    while (--i >= 0)
+	      reactor_teardown (&srv->reactors[i]);
+	    srv->reactor_count = 0;
+	    pthread_mutex_unlock (&srv->connect_mutex);
+	    return rtn;
+	  }
+	}
+	srv->stopping = false;
+	srv->is_connected = true;
+	pthread_mutex_unlock (&srv->connect_mutex);
+	return 0;
+}
+
+int cmsg_connect_server (const char *ip_addr, unsigned int port,
+  server_opts_t *options)
+{
+  return server_connect (&SRV, ip_addr, port, options);
+}
+
+cmsg_server_t *cmsg_srv_create (server_opts_t *options)
+{
+  static const struct cmsg_server defaults = SERVER_DEFAULTS;
+  struct cmsg_server *srv;
+
+  srv = (struct cmsg_server *) malloc (sizeof (struct cmsg_server));
+  if (NULL == srv) {
+    printf ("Unable to malloc server instance\n");
+    return NULL;
+  }
+  memcpy (srv, &defaults, sizeof (struct cmsg_server));
+  pthread_mutex_init (&srv->connect_mutex, NULL);
+  if (NULL != options)
+    server_set_opts (srv, options);
+  return srv;
+}
+
+int cmsg_srv_listen (cmsg_server_t *srv, const char *ip_addr, 
+  unsigned int port)
+{
+  return server_connect (srv, ip_addr, port, NULL);
+}
+
+void shutdown_sock (int sock)
+{
+    shutdown (sock, SHUT_RDWR);
+    close (sock);
+}
+
+// list_mutex must be held
+int conn_table_add (struct conn_table *table, struct connection *conn)
+{
+  int sock = conn->rcv_data.sock;
+
+  if (sock >= (1 << HANDLE_SOCK_BITS)) {
+    printf ("Socket %d is too big for a connection handle\n", sock);
+    return -1;
+  }
+  if (conn_table_reserve (table, sock + 1) != 0)
+    return -1;
+  // generation 0 is never issued, so handle 0 is never valid
+  if (++table->gens[sock] == 0)
+    table->gens[sock] = 1;
+  conn->rcv_data.handle = ((cmsg_conn_handle_t) table->gens[sock] << 32) 
+    | ((uint32_t) conn->rcv_data.reactor_id << HANDLE_SOCK_BITS)
+    | (uint32_t) sock;
+  table->slots[sock] = conn;
+  if (sock >= table->high)
+    table->high = sock + 1;
+  table->count++;
+  return 0;
+}
+
+// list_mutex must be held
+void conn_table_remove (struct conn_table *table, struct connection *conn)
+{
+  int sock = conn->rcv_data.sock;
+
+  if ((sock < 0) || (sock >= table->size) || (table->slots[sock] != conn))
+    return;
+  table->slots[sock] = NULL;
+  table->count--;
+  while ((table->high > 0) && (NULL == table->slots[table->high-1]))
+    table->high--;
+}
+
+// list_mutex must be held
+struct connection *conn_table_find (struct conn_table *table, int sock)
+{
+  if ((sock < 0) || (sock >= table->high))
+    return NULL;
+  return table->slots[sock];
+}
+
+// list_mutex must be held
+struct connection *conn_table_find_handle (struct conn_table *table, 
+  cmsg_conn_handle_t handle)
+{
+  uint32_t slot = (uint32_t) handle & ((1 << HANDLE_SOCK_BITS) - 1);
+  struct connection *conn;
+
+  if (slot >= (uint32_t) table->high)
+    return NULL;
+  conn = table->slots[slot];
+  if ((NULL == conn) || (conn->rcv_data.handle != handle))
+    return NULL;
+  return conn;
+}
+
+/*------------------------------------------------------------------
+ * Handler workers
+ *  With handler_threads set, reactors queue handler events instead of
+ *  calling the handler. Each connection has a mailbox of jobs. A
+ *  connection with jobs is put on its home worker's ready deque, and
+ *  is on at most one deque or worker at a time, so its events are
+ *  handled in order. An idle worker steals whole connections from the
+ *  tail of another worker's deque. A connection is not freed until
+ *  the jobs that point to it are done.
+---------------------------------------------------------------------*/
+
+// the job whose handler is running on this thread, for cmsg_msg_retain
+static __thread struct handler_job *CURRENT_JOB = NULL;
+
+unsigned int handle_worker_hash (int sock)
+{
+  return (uint32_t) sock * 2654435761u;
+}
+
+// wakes one sleeping worker other than w, to steal from w
+void worker_wake_thief (struct handler_worker *w)
+{
+  struct cmsg_server *srv = w->srv;
+  struct handler_worker *t;
+  int i;
+
+  for (i=0; i<srv->worker_count; i++) {
+    t = &srv->workers[i];
+    if ((t != w) && __atomic_load_n (&t->sleeping, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock (&t->mutex);
+      pthread_cond_signal (&t->cond);
+      pthread_mutex_unlock (&t->mutex);
+      return;
+    }
+  }
+}
+
+// puts a scheduled connection at the tail of w's ready deque
+void worker_ready (struct handler_worker *w, struct connection *conn)
+{
+  bool sleeping;
+
+  pthread_mutex_lock (&w->mutex);
+  conn->ready_next = NULL;
+  conn->ready_prev = w->ready_tail;
+  if (NULL == w->ready_tail)
+    w->ready_head = conn;
+  else
+    w->ready_tail->ready_next = conn;
+  w->ready_tail = conn;
+  sleeping = w->sleeping;
+  if (sleeping)
+    pthread_cond_signal (&w->cond);
+  pthread_mutex_unlock (&w->mutex);
+  // w is busy; let an idle worker take it
+  if (!sleeping)
+    worker_wake_thief (w);
+}
+
+// removes a connection from the head (owner) or tail (thief) of w's
+// ready deque. w->mutex must be held
+struct connection *worker_unready (struct handler_worker *w, bool tail)
+{
+  struct connection *conn = tail ? w->ready_tail : w->ready_head;
+
+  if (NULL == conn)
+    return NULL;
+  if (NULL == conn->ready_prev)
+    w->ready_head = conn->ready_next;
+  else
+    conn->ready_prev->ready_next = conn->ready_next;
+  if (NULL == conn->ready_next)
+    w->ready_tail = conn->ready_prev;
+  else
+    conn->ready_next->ready_prev = conn->ready_prev;
+  conn->ready_prev = conn->ready_next = NULL;
+  return conn;
+}
+
+// Adds a job to the connection's mailbox without a lock. The push
+// that finds the connection unscheduled puts it on a ready deque
+void mailbox_push (struct handler_worker *w, struct connection *conn,
+  struct handler_job *job)
+{
+  job->next = __atomic_load_n (&conn->mailbox, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&conn->mailbox, &job->next, job, 
+      true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    ;
+  if (!__atomic_exchange_n (&conn->scheduled, true, __ATOMIC_SEQ_CST))
+    worker_ready (w, conn);
+}
+
+// a high water mark of 0 is no limit. The low mark is half the high
+bool water_over (unsigned long count, unsigned long high)
+{
+  return (high != 0) && (count >= high);
+}
+
+bool water_under (unsigned long count, unsigned long high)
+{
+  return (high == 0) || (count <= high / 2);
+}
+
+// the connection's queues or the server's are over a high water mark
+bool conn_over_high_water (struct connection *conn)
+{
+  struct cmsg_server *srv = conn->rs->srv;
+
+  return water_over (__atomic_load_n (&conn->queued_msgs, __ATOMIC_SEQ_CST),
+      srv->conn_high_water_msgs) ||
+    water_over (__atomic_load_n (&conn->queued_bytes, __ATOMIC_SEQ_CST),
+      srv->conn_high_water_bytes) ||
+    water_over (__atomic_load_n (&srv->stats.queued_msgs, __ATOMIC_SEQ_CST),
+      srv->high_water_msgs) ||
+    water_over (__atomic_load_n (&srv->stats.queued_bytes, __ATOMIC_SEQ_CST),
+      srv->high_water_bytes);
+}
+
+// the connection's queues and the server's are at low water
+bool conn_under_low_water (struct connection *conn)
+{
+  struct cmsg_server *srv = conn->rs->srv;
+
+  return water_under (__atomic_load_n (&conn->queued_msgs, __ATOMIC_SEQ_CST),
+      srv->conn_high_water_msgs) &&
+    water_under (__atomic_load_n (&conn->queued_bytes, __ATOMIC_SEQ_CST),
+      srv->conn_high_water_bytes) &&
+    water_under (__atomic_load_n (&srv->stats.queued_msgs, __ATOMIC_SEQ_CST),
+      srv->high_water_msgs) &&
+    water_under (__atomic_load_n (&srv->stats.queued_bytes, __ATOMIC_SEQ_CST),
+      srv->high_water_bytes);
+}
+
+// brings the reactor out of its wait. Any thread
+void reactor_wake (struct reactor_stuff *rs)
+{
+  uint64_t one = 1;
+
+  if (rs->srv->reactor == CMSG_REACTOR_IO_URING) {
+    if (uring_queue (rs, IORING_OP_NOP, -1, NULL, 0, URING_TAG_NOP) == 0)
+      uring_enter (rs, uring_sq_pending (rs), 0, 0, NULL, 0);
+  } else
+    write (rs->wakeup_fd, &one, sizeof (one));
+}
+
+// asks the reactor to look over its paused connections. Any thread
+void reactor_resume_soon (struct reactor_stuff *rs)
+{
+  if (!__atomic_exchange_n (&rs->resume_check, true, __ATOMIC_SEQ_CST))
+    reactor_wake (rs);
+}
+
+// a queued msg was handled. Wakes the reactor of a paused connection
+// that is now at low water, or every reactor when the server's queues
+// have just reached low water
+void worker_unqueue (struct connection *conn, size_t size)
+{
+  struct cmsg_server *srv = conn->rs->srv;
+  unsigned long msgs, bytes;
+  size_t low_bytes = srv->high_water_bytes / 2;
+  int i;
+
+  __atomic_sub_fetch (&conn->queued_msgs, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch (&conn->queued_bytes, size, __ATOMIC_SEQ_CST);
+  msgs = __atomic_sub_fetch (&srv->stats.queued_msgs, 1, __ATOMIC_SEQ_CST);
+  bytes = __atomic_sub_fetch (&srv->stats.queued_bytes, size, 
+    __ATOMIC_SEQ_CST);
+  if (((srv->high_water_msgs != 0) && (msgs == srv->high_water_msgs / 2)) ||
+      ((srv->high_water_bytes != 0) && (bytes <= low_bytes) &&
+       (bytes + size > low_bytes))) {
+    for (i=0; i<srv->reactor_count; i++)
+      reactor_resume_soon (&srv->reactors[i]);
+  } else if (__atomic_load_n (&conn->rd_paused, __ATOMIC_SEQ_CST) &&
+      conn_under_low_water (conn))
+    reactor_resume_soon (conn->rs);
+}
+
+// Queues an event for the connection's worker. buf, if not NULL,
+// becomes the job's rcv_msg. Returns 0 or ENOMEM
+int worker_queue (struct connection *conn, int action, char *buf, 
+  size_t size, bool owned)
+{
+  struct handler_job *job;
+
+  job = (struct handler_job *) pool_alloc (sizeof (struct handler_job));
+  if (NULL == job) {
+    printf ("Unable to queue handler event for socket %d\n",
+      conn->rcv_data.sock);
+    if (owned)
+      pool_free (buf);
+    return ENOMEM;
+  }
+  job->conn = conn;
+  job->action = action;
+  job->buf = buf;
+  job->owned = owned;
+  job->size = size;
+  job->data = conn->rcv_data;
+  if (NULL != buf) {
+    job->data.rcv_msg = buf;
+    job->data.rcv_msg_size = size;
+    __atomic_add_fetch (&conn->queued_msgs, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch (&conn->queued_bytes, size, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch (&conn->rs->srv->stats.queued_msgs, 1, 
+      __ATOMIC_SEQ_CST);
+    __atomic_add_fetch (&conn->rs->srv->stats.queued_bytes, size,
+      __ATOMIC_SEQ_CST);
+  }
+  __atomic_add_fetch (&conn->refs, 1, __ATOMIC_ACQ_REL);
+  mailbox_push (conn->worker, conn, job);
+  return 0;
+}
+
+// an event without a msg, for the handler or the connection's worker
+void conn_event (struct connection *conn, int action, 
+  process_message_t handle_msg)
+{
+  if (NULL != conn->worker)
+    worker_queue (conn, action, NULL, 0, false);
+  else
+    handle_msg (action, &conn->rcv_data);
+}
+
+void worker_run_job (struct handler_worker *w, struct handler_job *job)
+{
+  struct connection *conn = job->conn;
+
+  // one worker at a time runs a connection's jobs, so this reads the
+  // last write to user_data by any of them
+  job->data.user_data = conn->rcv_data.user_data;
+  CURRENT_JOB = job;
+  w->srv->handle_msg (job->action, &job->data);
+  CURRENT_JOB = NULL;
+  STAT_INC (w, handler_jobs);
+  if (NULL != job->buf)
+    worker_unqueue (conn, job->size);
+  if (job->data.user_data != conn->rcv_data.user_data) {
+    // under the lock, for broadcast filters
+    pthread_mutex_lock (&conn->rs->list_mutex);
+    conn->rcv_data.user_data = job->data.user_data;
+    pthread_mutex_unlock (&conn->rs->list_mutex);
+  }
+  if (job->owned)
+    pool_free (job->buf);
+  conn_put (conn);
+  pool_free (job);
+}
+
+// Runs the jobs in a scheduled connection's mailbox, oldest first.
+// Jobs that arrive meanwhile put it back on w's deque
+void worker_run_conn (struct handler_worker *w, struct connection *conn)
+{
+  struct handler_job *jobs, *job, *next;
+  struct handler_job *fifo = NULL;
+
+  jobs = __atomic_exchange_n (&conn->mailbox, NULL, __ATOMIC_SEQ_CST);
+  for (job = jobs; NULL != job; job = next) {
+    next = job->next;
+    job->next = fifo;
+    fifo = job;
+  }
+  // the last job may drop the final ref, so keep conn alive until the
+  // mailbox is checked again
+  __atomic_add_fetch (&conn->refs, 1, __ATOMIC_ACQ_REL);
+  for (job = fifo; NULL != job; job = next) {
+    next = job->next;
+    worker_run_job (w, job);
+  }
+  __atomic_store_n (&conn->scheduled, false, __ATOMIC_SEQ_CST);
+  if ((NULL != __atomic_load_n (&conn->mailbox, __ATOMIC_SEQ_CST)) &&
+      !__atomic_exchange_n (&conn->scheduled, true, __ATOMIC_SEQ_CST))
+    worker_ready (w, conn);
+  conn_put (conn);
+}
+
+// takes a connection from the tail of another worker's deque
+struct connection *worker_steal (struct handler_worker *w)
+{
+  struct cmsg_server *srv = w->srv;
+  struct handler_worker *victim;
+  struct connection *conn;
+  int i, self = w - srv->workers;
+
+  for (i=1; i<srv->worker_count; i++) {
+    victim = &srv->workers[(self + i) % srv->worker_count];
+    if (NULL == __atomic_load_n (&victim->ready_tail, __ATOMIC_RELAXED))
+      continue;
+    pthread_mutex_lock (&victim->mutex);
+    conn = worker_unready (victim, true);
+    pthread_mutex_unlock (&victim->mutex);
+    if (NULL != conn) {
+      STAT_INC (w, handler_steals);
+      return conn;
+    }
+  }
+  return NULL;
+}
+
+// returns the next ready connection, own or stolen, or NULL after
+// waiting
+struct connection *worker_take (struct handler_worker *w)
+{
+  struct connection *conn;
+  bool more;
+
+  pthread_mutex_lock (&w->mutex);
+  conn = worker_unready (w, false);
+  more = (NULL != w->ready_head);
+  pthread_mutex_unlock (&w->mutex);
+  if (NULL != conn) {
+    if (more)
+      worker_wake_thief (w);
+    return conn;
+  }
+  conn = worker_steal (w);
+  if (NULL != conn)
+    return conn;
+  pthread_mutex_lock (&w->mutex);
+  __atomic_store_n (&w->sleeping, true, __ATOMIC_SEQ_CST);
+  if ((NULL == w->ready_head) &&
+      !__atomic_load_n (&w->srv->workers_stopping, __ATOMIC_SEQ_CST))
+    pthread_cond_wait (&w->cond, &w->mutex);
+  __atomic_store_n (&w->sleeping, false, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&w->mutex);
+  return NULL;
+}
+
+void *handler_worker_thread (void *arg)
+{
+  struct handler_worker *w = (struct handler_worker *) arg;
+  struct connection *conn;
+
+  while (1) {
+    conn = worker_take (w);
+    if (NULL != conn) {
+      worker_run_conn (w, conn);
+      continue;
+    }
+    // no reactor queues jobs once stopping is set, and a connection
+    // another worker runs goes back on that worker's deque
+    if (__atomic_load_n (&w->srv->workers_stopping, __ATOMIC_SEQ_CST) &&
+        (NULL == __atomic_load_n (&w->ready_head, __ATOMIC_SEQ_CST)))
+      break;
+  }
+  return NULL;
+}
+
+// returns 0 or an errno
+int workers_start (struct cmsg_server *srv)
+{
+  int i;
+  struct handler_worker *w;
+
+  srv->workers_stopping = false;
+  if (srv->handler_threads == 0)
+    return 0;
+  free (srv->workers);
+  srv->workers = (struct handler_worker *) calloc (srv->handler_threads,
+    sizeof (struct handler_worker));
+  if (NULL == srv->workers) {
+    printf ("Unable to malloc %u handler workers\n", srv->handler_threads);
+    return ENOMEM;
+  }
+  for (i=0; i<(int) srv->handler_threads; i++) {
+    w = &srv->workers[i];
+    w->srv = srv;
+    pthread_mutex_init (&w->mutex, NULL);
+    pthread_cond_init (&w->cond, NULL);
+    if (pthread_create (&w->thread, NULL, handler_worker_thread, w) != 0) {
+      printf ("Unable to start handler worker %d\n", i);
+      break;
+    }
+  }
+  __atomic_store_n (&srv->worker_count, i, __ATOMIC_RELEASE);
+  return 0;
+}
+
+#define STAT_FOLD(rs, field) STAT_ADD ((rs)->srv, field, \
+  __atomic_exchange_n (&(rs)->stats.field, 0, __ATOMIC_RELAXED))
+
+// every reactor has stopped, so no more jobs come in.
+// Workers finish what is queued first. The workers array is kept
+// until the next run or cmsg_srv_destroy, for cmsg_srv_get_stats
+void workers_stop (struct cmsg_server *srv)
+{
+  int i, count = srv->worker_count;
+  struct handler_worker *w;
+
+  __atomic_store_n (&srv->workers_stopping, true, __ATOMIC_SEQ_CST);
+  for (i=0; i<count; i++) {
+    w = &srv->workers[i];
+    pthread_mutex_lock (&w->mutex);
+    pthread_cond_signal (&w->cond);
+    pthread_mutex_unlock (&w->mutex);
+  }
+  for (i=0; i<count; i++) {
+    w = &srv->workers[i];
+    pthread_join (w->thread, NULL);
+    pthread_mutex_destroy (&w->mutex);
+    pthread_cond_destroy (&w->cond);
+    STAT_FOLD (w, handler_jobs);
+    STAT_FOLD (w, handler_steals);
+  }
+  __atomic_store_n (&srv->worker_count, 0, __ATOMIC_RELEASE);
+}
+
+// sets up a connection for an accepted socket
+struct connection *server_add_conn (struct reactor_stuff *rs, int sock, 
+  process_message_t handle_msg)
+{
+  struct connection *conn;
+
+  conn = conn_alloc (rs);
+  if (NULL == conn) {
+    printf ("Unable to malloc connection structure in receiver accept\n");
+    shutdown_sock (sock);
+    return NULL;
+  }
+  init_connection (conn);
+  conn->rcv_state = 0;
+  conn->rcv_data.sock = sock;
+  conn->rcv_data.reactor_id = rs->id;
+  conn->rs = rs;
+  conn->rcv_data.server = rs->srv;
+  if (rs->srv->worker_count > 0)
+    conn->worker = &rs->srv->workers[handle_worker_hash (sock) % 
+      rs->srv->worker_count];
+  if (rs->srv->reactor == CMSG_REACTOR_EPOLL)
+    if (epoll_add (rs, conn, sock) != 0) {
+      shutdown_sock (sock);
+      conn_free (rs, conn);
+      return NULL;
+    }
+  pthread_mutex_lock (&rs->list_mutex);
+  if (conn_table_add (&rs->conns, conn) != 0) {
+    pthread_mutex_unlock (&rs->list_mutex);
+    if (rs->epoll_fd != -1)
+      epoll_ctl (rs->epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+    shutdown_sock (sock);
+    conn_free (rs, conn);
+    return NULL;
+  }
+  conn_event (conn, CMSG_ACTION_CONN_ADDED, handle_msg);
+  pthread_mutex_unlock (&rs->list_mutex);
+  return conn;
+}
+
+int server_accept (struct reactor_stuff *rs, process_message_t handle_msg)
+{
   int i, sock, flags;
   struct connection *conn;
 
-  sock = accept (SRV.listen_sock, NULL, NULL);
+  sock = accept (rs->listen_sock, NULL, NULL);
+  STAT_INC (rs, accept_calls);
   if (sock < 0) {
     if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
       return 1;
     dbg_err (errno, "Accept error on receive socket: %s\n");
-    close (SRV.listen_sock);
+    close (rs->listen_sock);
     return 2;
   }
   printf ("Accepted %d\n", sock);
+  if ((rs->srv->reactor == CMSG_REACTOR_SELECT) && (sock >= FD_SETSIZE)) {
+    printf ("Socket %d exceeds FD_SETSIZE for select reactor\n", sock);
+    shutdown_sock (sock);
+    return -1;
+  }
 #if 0
   flags = fcntl (sock, F_GETFL);
   if (flags == -1) {
@@ -268,30 +1960,50 @@ int server_accept (process_message_t handle_msg)
 	return -1;
   }
 #endif
-  conn = (struct connection *) malloc (sizeof (struct connection));
-  if (NULL == conn) {
-    printf ("Unable to malloc connection structure in receiver accept\n");
+  if (NULL == server_add_conn (rs, sock, handle_msg))
     return -1;
-  }
-  init_connection (conn);
-  conn->rcv_state = 0;
-  conn->rcv_data.sock = sock;
-  pthread_mutex_lock (&SRV.list_mutex);
-  LL_APPEND (SRV.connection_list, conn);
-  handle_msg (CMSG_ACTION_CONN_ADDED, &conn->rcv_data);
-  pthread_mutex_unlock (&SRV.list_mutex);
   return 0;
 
 }
 
-void shutdown_sock (int sock)
+void release_shared_frame (struct shared_frame *shared)
 {
-    shutdown (sock, SHUT_RDWR);
-    close (sock);
+  if (__atomic_sub_fetch (&shared->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    pool_free (shared);
+}
+
+void free_out_frame (struct out_frame *frame)
+{
+  if (NULL != frame->shared)
+    release_shared_frame (frame->shared);
+  pool_free (frame);
+}
+
+void free_outq (struct connection *conn)
+{
+  struct out_frame *frame;
+
+  while (NULL != conn->outq_head) {
+    frame = conn->outq_head;
+    conn->outq_head = frame->next;
+    free_out_frame (frame);
+  }
+  conn->outq_tail = NULL;
+  conn->outq_bytes = 0;
+  conn->outq_frames = 0;
+}
+
+// frees the outq and a msg cut off by a drop
+void free_conn_bufs (struct connection *conn)
+{
+  free_outq (conn);
+  pool_free (conn->rcv_tmp);
+  conn->rcv_tmp = NULL;
 }
 
 void shutdown_connection (struct connection *conn)
 {
+  free_conn_bufs (conn);
   if (conn->rcv_state != -1) {
     shutdown (conn->rcv_data.sock, SHUT_RDWR);
     close (conn->rcv_data.sock);
@@ -299,30 +2011,324 @@ void shutdown_connection (struct connection *conn)
     conn->rcv_state = -1;
   }
 }
- 
-void shutdown_server (void)
+
+// sets what epoll watches a connection for. list_mutex must be held
+void conn_epoll_events (struct connection *conn)
 {
-  int i;
-  struct connection *conn;
-  struct connection *tmp;
+  struct epoll_event ev;
 
-  if (SRV.listen_sock != -1) {
-    LL_FOREACH_SAFE (SRV.connection_list, conn, tmp) {
-      LL_DELETE (SRV.connection_list, conn);
-      shutdown_connection (conn);
-      free (conn);
+  ev.events = (conn->rd_paused ? 0 : EPOLLIN) | 
+    (conn->want_write ? EPOLLOUT : 0);
+  ev.data.ptr = conn;
+  epoll_ctl (conn->rs->epoll_fd, EPOLL_CTL_MOD, conn->rcv_data.sock, &ev);
+}
+
+void conn_want_write (struct connection *conn, bool want)
+{
+  uint64_t one = 1;
+
+  if ((conn->want_write == want) || (conn->rs->srv->reactor == CMSG_REACTOR_IO_URING))
+    return;
+  conn->want_write = want;
+  if (conn->rs->srv->reactor == CMSG_REACTOR_EPOLL)
+    conn_epoll_events (conn);
+  else if (want) // select only watches for writable sockets it knows of
+    write (conn->rs->wakeup_fd, &one, sizeof (one));
+}
+
+// list_mutex must be held
+void conn_append_frame (struct connection *conn, struct out_frame *frame)
+{
+  frame->next = NULL;
+  if (NULL == conn->outq_tail)
+    conn->outq_head = frame;
+  else
+    conn->outq_tail->next = frame;
+  conn->outq_tail = frame;
+  conn->outq_bytes += frame->len - frame->sent;
+  conn->outq_frames++;
+  conn_want_write (conn, true);
+}
+
+bool outq_over (struct cmsg_server *srv, size_t bytes, unsigned int frames)
+{
+  return ((srv->outq_max_bytes != 0) && (bytes > srv->outq_max_bytes)) ||
+    ((srv->outq_max_frames != 0) && (frames > srv->outq_max_frames));
+}
+
+// list_mutex must be held. Frees the oldest frames none of which has
+// been sent, until len more bytes fit
+void outq_drop_oldest (struct connection *conn, size_t len)
+{
+  struct out_frame *prev = NULL;
+  struct out_frame *frame = conn->outq_head;
+  struct out_frame *next;
+  int busy = conn->send_inflight ? conn->inflight_frames : 0;
+
+  while ((NULL != frame) && outq_over (conn->rs->srv, 
+      conn->outq_bytes + len, conn->outq_frames + 1)) {
+    next = frame->next;
+    if ((busy > 0) || (frame->sent != 0)) {
+      busy--;
+      prev = frame;
+      frame = next;
+      continue;
     }
-    shutdown_sock (SRV.listen_sock);
+    if (NULL == prev)
+      conn->outq_head = next;
+    else
+      prev->next = next;
+    if (conn->outq_tail == frame)
+      conn->outq_tail = prev;
+    conn->outq_bytes -= frame->len;
+    conn->outq_frames--;
+    free_out_frame (frame);
+    STAT_INC (conn->rs, outq_drops);
+    frame = next;
   }
 }
 
-int cmsg_connect_client (struct client_conn *conn, 
-  const char *ip_addr, unsigned int port, unsigned int send_timeout_msecs)
+// list_mutex must be held. Marks the connection for the reactor to
+// tell the handler, once per overflow
+void conn_slow_consumer (struct connection *conn)
 {
-	int sock;
-	int reuse_opt = 1;
-	struct timeval send_timeout;
-	struct timeval rcv_timeout;
+  if (conn->outq_overflowed)
+    return;
+  conn->outq_overflowed = true;
+  conn->slow_pending = true;
+  STAT_INC (conn->rs, slow_consumers);
+  if (!__atomic_exchange_n (&conn->rs->slow_check, true, __ATOMIC_SEQ_CST))
+    reactor_wake (conn->rs);
+}
+
+// list_mutex must be held. Decides if a frame with len bytes unsent
+// can be queued, by the server's outq limits and policy. Returns 0,
+// ENOBUFS if it is dropped, or ECONNABORTED if the connection is
+// being dropped. The rest of a frame already partly sent is queued
+// unless the connection is going
+int conn_outq_admit (struct connection *conn, size_t len, bool partial)
+{
+  struct cmsg_server *srv = conn->rs->srv;
+
+  if (conn->outq_evict)
+    return ECONNABORTED;
+  if (!outq_over (srv, conn->outq_bytes + len, conn->outq_frames + 1))
+    return 0;
+  conn_slow_consumer (conn);
+  if (srv->outq_policy == CMSG_OUTQ_DISCONNECT) {
+    conn->outq_evict = true;
+    STAT_INC (conn->rs, outq_drops);
+    return ECONNABORTED;
+  }
+  if (srv->outq_policy == CMSG_OUTQ_DROP_OLDEST)
+    outq_drop_oldest (conn, len);
+  if (partial || 
+      !outq_over (srv, conn->outq_bytes + len, conn->outq_frames + 1))
+    return 0;
+  STAT_INC (conn->rs, outq_drops);
+  return ENOBUFS;
+}
+
+// list_mutex must be held. queues a copy of the frame, less the first
+// sent bytes that already went out
+int conn_queue_frame (struct connection *conn, const unsigned char *header,
+  size_t header_len, const struct iovec *iov, int iovcnt, size_t sent)
+{
+  struct out_frame *frame;
+  size_t len = header_len + iov_total (iov, iovcnt);
+  size_t pos = header_len;
+  int i, rtn;
+
+  rtn = conn_outq_admit (conn, len - sent, sent > 0);
+  if (rtn != 0)
+    return rtn;
+  frame = (struct out_frame *) pool_alloc (sizeof (struct out_frame) + len);
+  if (NULL == frame) {
+    printf ("Unable to malloc outbound frame for socket %d\n", 
+      conn->rcv_data.sock);
+    return ENOMEM;
+  }
+  frame->data = frame->own;
+  memcpy (frame->data, header, header_len);
+  for (i=0; i<iovcnt; i++) {
+    memcpy (frame->data+pos, iov[i].iov_base, iov[i].iov_len);
+    pos += iov[i].iov_len;
+  }
+  frame->len = len;
+  frame->sent = sent;
+  frame->shared = NULL;
+  conn_append_frame (conn, frame);
+  return 0;
+}
+
+// list_mutex must be held. queues a reference to a shared frame
+int conn_queue_shared (struct connection *conn, struct shared_frame *shared,
+  size_t sent)
+{
+  struct out_frame *frame;
+  int rtn;
+
+  rtn = conn_outq_admit (conn, shared->len - sent, sent > 0);
+  if (rtn != 0)
+    return rtn;
+  frame = (struct out_frame *) pool_alloc (sizeof (struct out_frame));
+  if (NULL == frame) {
+    printf ("Unable to malloc outbound frame for socket %d\n", 
+      conn->rcv_data.sock);
+    return ENOMEM;
+  }
+  __atomic_add_fetch (&shared->refs, 1, __ATOMIC_ACQ_REL);
+  frame->data = shared->data;
+  frame->len = shared->len;
+  frame->sent = sent;
+  frame->shared = shared;
+  conn_append_frame (conn, frame);
+  return 0;
+}
+
+// list_mutex must be held. frees the frames bytes have completed.
+// returns true if the queue is now empty
+bool outq_consume (struct connection *conn, size_t bytes)
+{
+  struct out_frame *frame;
+  size_t n;
+
+  while (bytes > 0) {
+    frame = conn->outq_head;
+    n = frame->len - frame->sent;
+    if (bytes < n) {
+      frame->sent += bytes;
+      conn->outq_bytes -= bytes;
+      return false;
+    }
+    bytes -= n;
+    conn->outq_head = frame->next;
+    conn->outq_bytes -= n;
+    conn->outq_frames--;
+    free_out_frame (frame);
+  }
+  if (NULL == conn->outq_head) {
+    conn->outq_tail = NULL;
+    conn->outq_overflowed = false;
+  }
+  return (NULL == conn->outq_head);
+}
+
+// list_mutex must be held. writes as much of the outbound queue as the
+// socket will take, several frames per sendmsg.
+// returns -1 if the connection failed
+int conn_flush_outq (struct connection *conn)
+{
+  struct iovec vec[OUTQ_FLUSH_FRAMES];
+  struct out_frame *frame;
+  struct msghdr mh;
+  ssize_t bytes;
+  int i;
+
+  while (NULL != conn->outq_head) {
+    i = 0;
+    for (frame = conn->outq_head; (NULL != frame) && (i < OUTQ_FLUSH_FRAMES);
+	 frame = frame->next, i++) {
+      vec[i].iov_base = frame->data + frame->sent;
+      vec[i].iov_len = frame->len - frame->sent;
+    }
+    memset (&mh, 0, sizeof (mh));
+    mh.msg_iov = vec;
+    mh.msg_iovlen = i;
+    bytes = sendmsg (conn->rcv_data.sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    STAT_INC (conn->rs, send_calls);
+    if (bytes < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        return 0;
+      conn->oserr = errno;
+      dbg_err (errno, "Error sending queued msgs\n");
+      return -1;
+    }
+    if (!outq_consume (conn, (size_t) bytes))
+      return 0;
+  }
+  conn_want_write (conn, false);
+  return 0;
+}
+ 
+// closes everything reactor_setup opened, and folds the reactor's
+// counters into the server's stats. The connection table is left empty, so a 
+// late send finds nothing
+void reactor_teardown (struct reactor_stuff *rs)
+{
+  int i;
+  struct connection *conn;
+  struct connection *tmp;
+
+  if (rs->listen_sock != -1) {
+    CONN_TABLE_FOREACH (rs->conns, i, conn) {
+      conn_table_remove (&rs->conns, conn);
+      shutdown_connection (conn);
+      conn_put (conn);
+    }
+    shutdown_sock (rs->listen_sock);
+    rs->listen_sock = -1;
+  }
+  free (rs->conns.slots);
+  rs->conns.slots = NULL;
+  free (rs->conns.gens);
+  rs->conns.gens = NULL;
+  rs->conns.size = 0;
+  if (rs->epoll_fd != -1) {
+    close (rs->epoll_fd);
+    rs->epoll_fd = -1;
+  }
+  if (rs->wakeup_fd != -1) {
+    close (rs->wakeup_fd);
+    rs->wakeup_fd = -1;
+  }
+  free (rs->rcv_buf);
+  rs->rcv_buf = NULL;
+  if (rs->uring.fd != -1) {
+    // closing the ring ends any requests still in flight
+    uring_teardown (rs);
+    DL_FOREACH_SAFE (rs->uring.closing_list, conn, tmp) {
+      DL_DELETE (rs->uring.closing_list, conn);
+      close (conn->rcv_data.sock);
+      free_conn_bufs (conn);
+      conn_put (conn);
+    }
+  }
+  conn_slab_teardown (&rs->slab);
+  STAT_FOLD (rs, msgs_received);
+  STAT_FOLD (rs, msgs_sent);
+  STAT_FOLD (rs, wait_calls);
+  STAT_FOLD (rs, accept_calls);
+  STAT_FOLD (rs, recv_calls);
+  STAT_FOLD (rs, send_calls);
+  STAT_FOLD (rs, uring_enter_calls);
+  STAT_FOLD (rs, conn_heap_allocs);
+  STAT_FOLD (rs, read_pauses);
+  STAT_FOLD (rs, outq_drops);
+  STAT_FOLD (rs, slow_consumers);
+  STAT_FOLD (rs, slow_evictions);
+  rs->stats.conns_paused = 0;
+}
+
+// every reactor thread has stopped
+void shutdown_server (struct cmsg_server *srv)
+{
+  int i;
+
+  pthread_mutex_lock (&srv->connect_mutex);
+  for (i=0; i<srv->reactor_count; i++)
+    reactor_teardown (&srv->reactors[i]);
+  srv->is_connected = false;
+  srv->is_listening = false;
+  pthread_mutex_unlock (&srv->connect_mutex);
+}
+
+int cmsg_connect_client (struct client_conn *conn, 
+  const char *ip_addr, unsigned int port, unsigned int send_timeout_msecs)
+{
+	int sock;
+	int reuse_opt = 1;
+	struct timeval send_timeout;
 
 	init_client_conn (conn);
 
@@ -349,312 +2355,2519 @@ int cmsg_connect_client (struct client_conn *conn,
 	 		return -1;
 		}
 	}
-	rcv_timeout.tv_sec = 0;
-	rcv_timeout.tv_usec = 500000;
-	if (setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, 
-		  &rcv_timeout, sizeof (rcv_timeout)) < 0) {
-			conn->oserr = errno;
-			dbg_err (errno, "Unable to set socket rcv timeout: \n");
-			close (sock);
-	 		return -1;
-		}
+	// a receive waits on it as well as the socket, instead of
+	// timing out to look at conn->terminated
+	conn->wakeup_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (conn->wakeup_fd < 0) {
+		conn->oserr = errno;
+		dbg_err (errno, "Unable to create client wakeup eventfd\n");
+		close (sock);
+		return -1;
+	}
 	if (connect (sock, (struct sockaddr *) &conn->addr, sizeof (conn->addr)) < 0) {
 		conn->oserr = errno;
 		dbg_err (errno, "Unable to connect to client socket\n");
 		shutdown (sock, SHUT_RDWR);
 		close (sock);
+		close (conn->wakeup_fd);
+		conn->wakeup_fd = -1;
 		return -1;
 	}
 	conn->sock = sock;
 	return 0;
 }
 
-void cmsg_shutdown_client (struct client_conn *conn)
+void cmsg_client_terminate (struct client_conn *conn)
+{
+  uint64_t one = 1;
+
+  __atomic_store_n (&conn->terminated, true, __ATOMIC_RELEASE);
+  if (conn->wakeup_fd != -1)
+    write (conn->wakeup_fd, &one, sizeof (one));
+}
+
+void free_client_frames (struct client_frame *frame);
+void client_coalesce_end (struct client_conn *conn);
+
+void cmsg_shutdown_client (struct client_conn *conn)
+{
+  if (conn->sock != -1) {
+	cmsg_client_terminate (conn);
+	client_coalesce_end (conn);
+	shutdown_sock (conn->sock);
+	free_client_frames (__atomic_exchange_n (&conn->sendq, NULL, 
+	  __ATOMIC_SEQ_CST));
+	close (conn->wakeup_fd);
+	conn->wakeup_fd = -1;
+	free (conn->rcv_buf);
+	conn->rcv_buf = NULL;
+	conn->rcv_buf_size = 0;
+	pthread_mutex_destroy (&conn->send_mutex);
+	pthread_mutex_destroy (&conn->rcv_mutex);
+	conn->sock = -1;
+  }
+}
+
+
+// A client tries the socket first, and only when it is empty waits for
+// it or its wakeup fd, for rcv_wait_msecs, -1 being no timeout. A wait
+// that times out fails with ETIMEDOUT. Returns -2 once the client is
+// terminated. The server reads sockets its reactor reported ready
+ssize_t socket_receive (struct connection *conn, void *buf, size_t len, 
+  struct client_conn *cconn)
+{
+  ssize_t bytes;
+  struct pollfd fds[2];
+  int rtn;
+
+  while (true) {
+    if ((NULL != cconn) && __atomic_load_n (&cconn->terminated, __ATOMIC_ACQUIRE))
+      return -2;
+    bytes = recv (conn->rcv_data.sock, buf, len, 
+      (NULL != cconn) ? MSG_DONTWAIT : 0);
+    if (bytes >= 0)
+      return bytes;
+    if ((NULL == cconn) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+      break;
+    fds[0].fd = conn->rcv_data.sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = cconn->wakeup_fd;
+    fds[1].events = POLLIN;
+    rtn = poll (fds, 2, cconn->rcv_wait_msecs);
+    if (rtn == 0) {
+      errno = ETIMEDOUT;
+      break;
+    }
+    if ((rtn < 0) && (errno != EINTR))
+      break;
+  }
+  conn->oserr = errno;
+  return -1;
+}
+
+// the size of a header, from its first byte
+size_t msg_header_size (const unsigned char *header)
+{
+  if (header[0] == MSG_HEADER_MARK_V2)
+    return MSG_HEADER_SIZE_V2;
+  return MSG_HEADER_SIZE_V1;
+}
+
+// checks a v1 or v2 header and returns the payload size, or -1
+ssize_t check_msg_header (const unsigned char *header, int *flags, 
+  int *msg_type)
+{
+  if ((header[0] == MSG_HEADER_MARK_V2) && (header[1] == MSG_HEADER_MARK_V2)) {
+    *flags = header[2];
+    *msg_type = header[3];
+    return (ssize_t) get_be32 (header+4);
+  }
+  if ((header[0] != MSG_HEADER_MARK) || (header[1] != MSG_HEADER_MARK)) {
+	printf ("Invalid msg header mark\n");
+	return -1;
+  }
+  *flags = 0;
+  *msg_type = 0;
+  return (ssize_t) (((size_t) header[2] << 8) + (size_t) header[3]); 
+}
+
+// A v2 header is only taken from a connection that agreed to v2, or
+// for the hello asking for it, and a payload may not be over
+// max_msg_size, so a header alone cannot make the server allocate
+// much. Returns -1 if the connection should be dropped
+int conn_check_header (struct connection *conn, const unsigned char *header)
+{
+  ssize_t msg_size;
+  int flags, msg_type;
+
+  msg_size = check_msg_header (header, &flags, &msg_type);
+  if (msg_size < 0)
+    return -1;
+  if ((msg_header_size (header) == MSG_HEADER_SIZE_V2) &&
+      (conn->rcv_data.protocol != CMSG_PROTOCOL_V2) &&
+      !(flags & MSG_FLAG_HELLO)) {
+    printf ("v2 msg on v1 socket %d\n", conn->rcv_data.sock);
+    return -1;
+  }
+  if ((size_t) msg_size > conn->rs->srv->max_msg_size) {
+    printf ("Msg of %zd bytes over max_msg_size on socket %d\n", 
+      msg_size, conn->rcv_data.sock);
+    return -1;
+  }
+  return 0;
+}
+
+// checks a header and allocates the msg buffer for its payload,
+// unless the payload is big enough to be streamed
+int parse_msg_header (struct connection *conn, const unsigned char *header,
+  bool can_stream)
+{
+  ssize_t msg_size = check_msg_header (header, &conn->rcv_flags, 
+    &conn->rcv_data.msg_type);
+
+  if (msg_size < 0)
+    return -1;
+  if (can_stream && (conn->rs->srv->stream_threshold != 0) &&
+      ((size_t) msg_size >= conn->rs->srv->stream_threshold) &&
+      !(conn->rcv_flags & MSG_FLAG_HELLO)) {
+    conn->rcv_data.stream_msg_size = msg_size;
+    conn->rcv_end_pos = 0;
+    conn->rcv_state = 2;
+    return 0;
+  }
+  conn->rcv_data.rcv_msg = pool_alloc (msg_size);
+  conn->rcv_tmp = conn->rcv_data.rcv_msg;
+  if (NULL == conn->rcv_data.rcv_msg) {
+    printf ("Unable to malloc msg buffer for socket %d\n", conn->rcv_data.sock);
+    return -1;
+  }
+  conn->rcv_data.rcv_msg_size = msg_size;
+  conn->rcv_end_pos = 0;
+  conn->rcv_state = 1;
+  return 0;
+}
+
+void server_hello (struct connection *conn, const char *msg, size_t msg_size);
+
+void deliver_msg (struct connection *conn, process_message_t handle_msg)
+{
+  conn->rcv_state = 0;
+  // negotiation is the library's business, not the handler's
+  if ((NULL != handle_msg) && (conn->rcv_flags & MSG_FLAG_HELLO)) {
+    server_hello (conn, conn->rcv_data.rcv_msg, conn->rcv_data.rcv_msg_size);
+    pool_free (conn->rcv_tmp);
+    conn->rcv_data.rcv_msg = NULL;
+  } else if (NULL != conn->worker) {
+    STAT_INC (conn->rs, msgs_received);
+    // the buffer goes with the job
+    worker_queue (conn, CMSG_ACTION_MSG_RECEIVED, conn->rcv_tmp,
+      conn->rcv_data.rcv_msg_size, conn->rs->srv->zero_copy_delivery);
+  } else if (NULL != handle_msg) {
+    STAT_INC (conn->rs, msgs_received);
+    handle_msg (CMSG_ACTION_MSG_RECEIVED, &conn->rcv_data);
+    // zero copy handlers do not free. cmsg_msg_retain may have taken it
+    if (conn->rs->srv->zero_copy_delivery)
+      pool_free (conn->rcv_tmp);
+  }
+  conn->rcv_tmp = NULL;
+}
+
+// hands a complete frame sitting in a read buffer to the handler as is
+void deliver_msg_view (struct connection *conn, const char *msg,
+  size_t msg_size, process_message_t handle_msg)
+{
+  conn->rcv_data.rcv_msg = (char *) msg;
+  conn->rcv_data.rcv_msg_size = msg_size;
+  conn->rcv_tmp = NULL;
+  STAT_INC (conn->rs, msgs_received);
+  handle_msg (CMSG_ACTION_MSG_RECEIVED, &conn->rcv_data);
+  conn->rcv_data.rcv_msg = NULL;
+}
+
+// hands the next piece of a streamed msg to the handler, straight from
+// the read buffer. The msg ends with CMSG_ACTION_MSG_END
+void deliver_chunk (struct connection *conn, const char *data, size_t len,
+  process_message_t handle_msg)
+{
+  char *copy;
+
+  conn->rcv_data.rcv_msg = (char *) data;
+  conn->rcv_data.rcv_msg_size = len;
+  conn->rcv_data.stream_pos = conn->rcv_end_pos;
+  if (NULL != conn->worker) {
+    // the read buffer is reused before the worker gets to it
+    copy = (char *) pool_alloc (len);
+    if (NULL != copy) {
+      memcpy (copy, data, len);
+      worker_queue (conn, CMSG_ACTION_MSG_CHUNK, copy, len, true);
+    } else
+      printf ("Unable to malloc msg chunk for socket %d\n", 
+        conn->rcv_data.sock);
+  } else
+    handle_msg (CMSG_ACTION_MSG_CHUNK, &conn->rcv_data);
+  conn->rcv_end_pos += len;
+  if (conn->rcv_end_pos < conn->rcv_data.stream_msg_size)
+    return;
+  conn->rcv_state = 0;
+  conn->rcv_data.rcv_msg = NULL;
+  conn->rcv_data.rcv_msg_size = 0;
+  STAT_INC (conn->rs, msgs_received);
+  conn_event (conn, CMSG_ACTION_MSG_END, handle_msg);
+}
+
+char *cmsg_msg_retain (server_rcv_msg_data_t *rcv_msg_data)
+{
+  struct connection *conn = (struct connection *)
+    ((char *) rcv_msg_data - offsetof (struct connection, rcv_data));
+  struct handler_job *job = CURRENT_JOB;
+  char *msg = rcv_msg_data->rcv_msg;
+
+  if ((NULL != job) && (rcv_msg_data == &job->data)) {
+    // called from a handler worker. The job has the buffer
+    if (!job->owned)
+      return msg;
+    if ((NULL != msg) && (msg == job->buf)) {
+      job->owned = false;
+      return msg;
+    }
+  } else {
+    // a chunk is always in the read buffer
+    if (!conn->rs->srv->zero_copy_delivery && (conn->rcv_state != 2))
+      return msg;
+    if ((NULL != msg) && (msg == conn->rcv_tmp)) {
+      conn->rcv_tmp = NULL;
+      return msg;
+    }
+  }
+  msg = (char *) pool_alloc (rcv_msg_data->rcv_msg_size);
+  if (NULL == msg) {
+    printf ("Unable to malloc retained msg for socket %d\n", rcv_msg_data->sock);
+    return NULL;
+  }
+  memcpy (msg, rcv_msg_data->rcv_msg, rcv_msg_data->rcv_msg_size);
+  return msg;
+}
+
+// Runs bytes that were already received through the frame parser,
+// calling handle_msg for every msg they complete. A header or payload
+// cut off at the end is kept in the connection for the next call.
+// Returns -1 on a bad header
+int conn_feed (struct connection *conn, const char *data, size_t len,
+  process_message_t handle_msg)
+{
+  size_t n, header_size;
+  ssize_t msg_size;
+  int flags;
+  struct cmsg_server *srv = conn->rs->srv;
+
+  while (len > 0) {
+    if ((conn->rcv_state == 0) && (conn->rcv_header_len == 0) &&
+        srv->zero_copy_delivery && (NULL != handle_msg) &&
+        (NULL == conn->worker) &&
+        (len >= msg_header_size ((const unsigned char *) data))) {
+      header_size = msg_header_size ((const unsigned char *) data);
+      if (conn_check_header (conn, (const unsigned char *) data) != 0)
+        return -1;
+      msg_size = check_msg_header ((const unsigned char *) data, &flags,
+        &conn->rcv_data.msg_type);
+      if (msg_size < 0)
+        return -1;
+      if ((len - header_size >= (size_t) msg_size) &&
+          ((srv->stream_threshold == 0) || 
+           ((size_t) msg_size < srv->stream_threshold))) {
+        if (flags & MSG_FLAG_HELLO)
+          server_hello (conn, data + header_size, (size_t) msg_size);
+        else
+          deliver_msg_view (conn, data + header_size, 
+            (size_t) msg_size, handle_msg);
+        data += header_size + msg_size;
+        len -= header_size + msg_size;
+        continue;
+      }
+    }
+    if (conn->rcv_state == 0) {
+      // the first byte tells if there is a v2 header to finish
+      if (conn->rcv_header_len == 0)
+        n = MSG_HEADER_SIZE_V1;
+      else
+        n = msg_header_size (conn->rcv_header) - conn->rcv_header_len;
+      if (n > len)
+        n = len;
+      memcpy (conn->rcv_header + conn->rcv_header_len, data, n);
+      conn->rcv_header_len += n;
+      data += n;
+      len -= n;
+      if (conn->rcv_header_len < MSG_HEADER_SIZE_V1)
+        return 0;
+      if (conn->rcv_header_len < msg_header_size (conn->rcv_header))
+        continue;
+      conn->rcv_header_len = 0;
+      if ((conn_check_header (conn, conn->rcv_header) != 0) ||
+          (parse_msg_header (conn, conn->rcv_header, NULL != handle_msg) != 0))
+        return -1;
+    } else if (conn->rcv_state == 1) {
+      n = conn->rcv_data.rcv_msg_size - conn->rcv_end_pos;
+      if (n > len)
+        n = len;
+      memcpy (conn->rcv_data.rcv_msg + conn->rcv_end_pos, data, n);
+      conn->rcv_end_pos += n;
+      data += n;
+      len -= n;
+    } else if (conn->rcv_state == 2) {
+      n = conn->rcv_data.stream_msg_size - conn->rcv_end_pos;
+      if (n > len)
+        n = len;
+      deliver_chunk (conn, data, n, handle_msg);
+      data += n;
+      len -= n;
+      continue;
+    } else
+      return -1;
+    if ((conn->rcv_state == 1) &&
+        (conn->rcv_end_pos == conn->rcv_data.rcv_msg_size))
+      deliver_msg (conn, handle_msg);
+  }
+  return 0;
+}
+
+int receive_msg_header (struct connection *conn, struct client_conn *cconn)
+{
+  int sock = conn->rcv_data.sock;
+  ssize_t bytes, msg_size;
+  int flags, msg_type;
+  unsigned char header[MSG_HEADER_MAX];
+
+  bytes = socket_receive (conn, header, 4, cconn);
+  if (bytes < 0) { 
+    if (bytes == -1)
+      dbg_err (conn->oserr, "Error receiving msg header\n");
+    return bytes;
+  }
+  if (bytes == 0) {
+	printf ("Sender %d closed\n", sock);
+	return -1;
+  }
+  if (bytes != 4) {
+	printf ("Expecting 4 byte msg header. Got %d bytes\n", bytes);
+	return -1;
+  }
+  if (msg_header_size (header) == MSG_HEADER_SIZE_V2) {
+    bytes = socket_receive (conn, header+4, 4, cconn);
+    if (bytes < 0) { 
+      if (bytes == -1)
+        dbg_err (conn->oserr, "Error receiving msg header\n");
+      return bytes;
+    }
+    if (bytes != 4) {
+	printf ("Expecting 8 byte msg header. Got %d bytes\n", bytes + 4);
+	return -1;
+    }
+  }
+  msg_size = check_msg_header (header, &flags, &msg_type);
+  if ((msg_size >= 0) && ((size_t) msg_size > cconn->max_msg_size)) {
+    printf ("Msg of %zd bytes over max_msg_size on socket %d\n",
+      msg_size, sock);
+    return -1;
+  }
+  return parse_msg_header (conn, header, false);
+}
+
+
+// returned msg must be freed
+int receive_msg_data (struct connection *conn, process_message_t handle_msg,
+  struct client_conn *cconn)
+{
+  ssize_t bytes;
+  size_t read_len = conn->rcv_data.rcv_msg_size - conn->rcv_end_pos;
+  int sock = conn->rcv_data.sock;
+  char *buf = conn->rcv_data.rcv_msg;
+
+  bytes = socket_receive (conn, buf+conn->rcv_end_pos, read_len, cconn);
+
+  if (bytes < 0) { 
+    if (bytes == -1)
+      dbg_err (conn->oserr, "Error receiving msg header\n");
+    return bytes;
+  }
+
+  if (bytes > read_len) {
+    printf ("bytes received %d not eq read_len in header %u\n",
+	bytes, read_len);
+    return -1;
+  }
+  conn->rcv_end_pos += bytes;
+  if (bytes < read_len) {
+    printf ("Not all bytes received, only %d of %d. Waiting for remainder\n",
+      bytes, read_len);
+    return 0;
+  }
+  deliver_msg (conn, handle_msg);
+  return 1;
+}
+
+// Makes room in the receive buffer for need bytes from rcv_head on.
+// The unread bytes are moved back to the start when the frame would
+// run off the end, and the buffer doubles when it cannot hold the
+// frame at all. A buffer grown for a big msg goes back to
+// CMSG_RCV_BUF_SIZE once it is empty. rcv_mutex must be held
+int client_rcv_room (struct client_conn *conn, size_t need)
+{
+  size_t held = conn->rcv_tail - conn->rcv_head;
+  size_t size;
+  char *buf;
+
+  if (held == 0) {
+    conn->rcv_head = conn->rcv_tail = 0;
+    if ((conn->rcv_buf_size > CMSG_RCV_BUF_SIZE) && 
+        (need <= CMSG_RCV_BUF_SIZE)) {
+      free (conn->rcv_buf);
+      conn->rcv_buf = NULL;
+      conn->rcv_buf_size = 0;
+    }
+  }
+  if (conn->rcv_head + need <= conn->rcv_buf_size)
+    return 0;
+  if (need <= conn->rcv_buf_size) {
+    memmove (conn->rcv_buf, conn->rcv_buf + conn->rcv_head, held);
+  } else {
+    size = (conn->rcv_buf_size == 0) ? CMSG_RCV_BUF_SIZE : conn->rcv_buf_size;
+    while (size < need)
+      size *= 2;
+    buf = (char *) malloc (size);
+    if (NULL == buf) {
+      printf ("Unable to malloc %zu byte receive buffer for socket %d\n", 
+        size, conn->sock);
+      return ENOMEM;
+    }
+    if (held != 0)
+      memcpy (buf, conn->rcv_buf + conn->rcv_head, held);
+    free (conn->rcv_buf);
+    conn->rcv_buf = buf;
+    conn->rcv_buf_size = size;
+  }
+  conn->rcv_head = 0;
+  conn->rcv_tail = held;
+  return 0;
+}
+
+// Returns the next msg from the receive buffer, reading the socket
+// only when the buffer does not hold all of it. Each read takes as
+// much as the socket has, so small msgs come many to a recv.
+// rcv_mutex must be held
+ssize_t client_rcv_frame (struct client_conn *cconn, const char **msg)
+{
+  struct connection rconn;
+  const unsigned char *header;
+  size_t need, held;
+  ssize_t msg_size, bytes;
+  int flags, msg_type;
+
+  init_connection (&rconn);
+  rconn.rcv_data.sock = cconn->sock;
+  while (true) {
+    held = cconn->rcv_tail - cconn->rcv_head;
+    need = MSG_HEADER_SIZE_V1;
+    if (held >= need) {
+      header = (const unsigned char *) cconn->rcv_buf + cconn->rcv_head;
+      need = msg_header_size (header);
+      if (held >= need) {
+        msg_size = check_msg_header (header, &flags, &msg_type);
+        if (msg_size < 0)
+          return -1;
+        if ((size_t) msg_size > cconn->max_msg_size) {
+          printf ("Msg of %zd bytes over max_msg_size on socket %d\n",
+            msg_size, cconn->sock);
+          return -1;
+        }
+        if (held - need >= (size_t) msg_size) {
+          *msg = cconn->rcv_buf + cconn->rcv_head + need;
+          cconn->rcv_head += need + (size_t) msg_size;
+          cconn->rcv_msg_type = msg_type;
+          cconn->rcv_count++;
+          return msg_size;
+        }
+        need += (size_t) msg_size;
+      }
+    }
+    if (client_rcv_room (cconn, need) != 0)
+      return -1;
+    bytes = socket_receive (&rconn, cconn->rcv_buf + cconn->rcv_tail, 
+      cconn->rcv_buf_size - cconn->rcv_tail, cconn);
+    if (bytes < 0) {
+      if (bytes == -1) {
+        cconn->oserr = rconn.oserr;
+        dbg_err (cconn->oserr, "Error receiving msg\n");
+      }
+      return bytes;
+    }
+    if (bytes == 0) {
+      printf ("Sender %d closed\n", cconn->sock);
+      return -1;
+    }
+    cconn->rcv_tail += (size_t) bytes;
+  }
+}
+
+ssize_t cmsg_client_receive_buf (struct client_conn *cconn, const char **msg)
+{
+  ssize_t rtn;
+
+  pthread_mutex_lock (&cconn->rcv_mutex);
+  rtn = client_rcv_frame (cconn, msg);
+  pthread_mutex_unlock (&cconn->rcv_mutex);
+  return rtn;
+}
+
+// the msg is copied out of the receive buffer into one the caller owns
+ssize_t cmsg_client_receive (struct client_conn *cconn)
+{
+  const char *msg;
+  ssize_t rtn;
+
+  pthread_mutex_lock (&cconn->rcv_mutex);
+  rtn = client_rcv_frame (cconn, &msg);
+  if (rtn >= 0) {
+    cconn->rcv_msg = (char *) pool_alloc ((size_t) rtn);
+    if (NULL == cconn->rcv_msg) {
+      printf ("Unable to malloc msg buffer for socket %d\n", cconn->sock);
+      rtn = -1;
+    } else {
+      memcpy (cconn->rcv_msg, msg, (size_t) rtn);
+      cconn->rcv_msg_size = (size_t) rtn;
+    }
+  }
+  pthread_mutex_unlock (&cconn->rcv_mutex);
+  return rtn;
+}
+
+/*------------------------------------------------------------------
+ * Backpressure
+ *  A connection whose msgs are queued for handler workers faster than
+ *  they are handled stops being read once it, or the whole server, is
+ *  over a high water mark, so TCP pushes back on the sender instead of
+ *  the heap growing. Reads resume once both are at low water. Only
+ *  the reactor pauses and resumes its connections; workers wake it.
+---------------------------------------------------------------------*/
+
+void uring_arm_recv (struct connection *conn, process_message_t handle_msg);
+void uring_feed_held (struct connection *conn, process_message_t handle_msg);
+
+// called by the reactor after it reads from a connection
+void conn_check_pause (struct connection *conn)
+{
+  struct reactor_stuff *rs = conn->rs;
+
+  if ((NULL == conn->worker) || conn->rd_paused || (conn->rcv_state < 0) ||
+      !conn_over_high_water (conn))
+    return;
+  pthread_mutex_lock (&rs->list_mutex);
+  __atomic_store_n (&conn->rd_paused, true, __ATOMIC_SEQ_CST);
+  if (rs->srv->reactor == CMSG_REACTOR_EPOLL)
+    conn_epoll_events (conn);
+  pthread_mutex_unlock (&rs->list_mutex);
+  // ends the multishot recv now. data it already took is still
+  // delivered
+  if ((rs->srv->reactor == CMSG_REACTOR_IO_URING) &&
+      (uring_queue (rs, IORING_OP_ASYNC_CANCEL, -1, conn, 0, 
+        URING_TAG_NOP) == 0))
+    uring_enter (rs, uring_sq_pending (rs), 0, 0, NULL, 0);
+  __atomic_add_fetch (&rs->stats.conns_paused, 1, __ATOMIC_SEQ_CST);
+  STAT_INC (rs, read_pauses);
+  // a worker may have drained it before it saw rd_paused
+  if (conn_under_low_water (conn))
+    __atomic_store_n (&rs->resume_check, true, __ATOMIC_SEQ_CST);
+}
+
+// list_mutex must be held
+void conn_unpause (struct connection *conn)
+{
+  if (!conn->rd_paused)
+    return;
+  __atomic_store_n (&conn->rd_paused, false, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch (&conn->rs->stats.conns_paused, 1, __ATOMIC_SEQ_CST);
+  if ((conn->rs->srv->reactor == CMSG_REACTOR_EPOLL) && 
+      (conn->rcv_state >= 0))
+    conn_epoll_events (conn);
+}
+
+// reads again from paused connections that are at low water, once a
+// worker or a pause has asked
+void reactor_resume_reads (struct reactor_stuff *rs, 
+  process_message_t handle_msg)
+{
+  struct connection *conn;
+  int i;
+
+  if (!__atomic_exchange_n (&rs->resume_check, false, __ATOMIC_SEQ_CST))
+    return;
+  CONN_TABLE_FOREACH (rs->conns, i, conn) {
+    if (!conn->rd_paused || !conn_under_low_water (conn))
+      continue;
+    pthread_mutex_lock (&rs->list_mutex);
+    conn_unpause (conn);
+    pthread_mutex_unlock (&rs->list_mutex);
+    if (rs->srv->reactor != CMSG_REACTOR_IO_URING)
+      continue;
+    uring_feed_held (conn, handle_msg);
+    if (conn->recv_stopped && !conn->rd_paused && (conn->rcv_state >= 0)) {
+      conn->recv_stopped = false;
+      uring_arm_recv (conn, handle_msg);
+    }
+  }
+}
+
+void server_drop_conn (struct connection *conn, process_message_t handle_msg);
+void server_close_conn (struct connection *conn);
+void uring_drop_conn (struct connection *conn, process_message_t handle_msg);
+void uring_release_conn (struct connection *conn);
+
+// Gives the handler CMSG_ACTION_SLOW_CONSUMER for connections whose
+// outq overflowed, and drops those the policy evicts. Sends only mark
+// them, since they run under list_mutex on any thread
+void reactor_slow_consumers (struct reactor_stuff *rs, 
+  process_message_t handle_msg)
+{
+  struct connection *conn;
+  bool pending, evict;
+  int i;
+
+  if (!__atomic_exchange_n (&rs->slow_check, false, __ATOMIC_SEQ_CST))
+    return;
+  CONN_TABLE_FOREACH (rs->conns, i, conn) {
+    if (conn->rcv_state < 0)
+      continue;
+    pthread_mutex_lock (&rs->list_mutex);
+    pending = conn->slow_pending;
+    conn->slow_pending = false;
+    evict = conn->outq_evict;
+    pthread_mutex_unlock (&rs->list_mutex);
+    if (pending)
+      conn_event (conn, CMSG_ACTION_SLOW_CONSUMER, handle_msg);
+    if (!evict)
+      continue;
+    printf ("Dropping slow consumer on socket %d\n", conn->rcv_data.sock);
+    STAT_INC (rs, slow_evictions);
+    if (rs->srv->reactor == CMSG_REACTOR_IO_URING) {
+      uring_drop_conn (conn, handle_msg);
+      uring_release_conn (conn);
+    } else {
+      server_drop_conn (conn, handle_msg);
+      pthread_mutex_lock (&rs->list_mutex);
+      server_close_conn (conn);
+      pthread_mutex_unlock (&rs->list_mutex);
+    }
+  }
+}
+
+void server_drop_conn (struct connection *conn, process_message_t handle_msg)
+{
+  if (conn->rcv_state < 0)
+    return;
+  // under the lock, so a broadcast is never still looking at user_data
+  // once the handler frees it
+  pthread_mutex_lock (&conn->rs->list_mutex);
+  conn->rcv_state = -2;
+  pthread_mutex_unlock (&conn->rs->list_mutex);
+  conn_event (conn, CMSG_ACTION_CONN_DROPPED, handle_msg);
+}
+
+// Reads whatever one ready connection has into the server read buffer
+// and parses every complete msg out of it. The rest of a payload too
+// big for the read buffer is read straight into the msg.
+// sets rcv_state -2 if dropped
+void server_receive_conn (struct connection *conn, process_message_t handle_msg)
+{
+  ssize_t bytes;
+  size_t remaining = 0;
+  int rtn = 0;
+
+  if (conn->rcv_state < 0)
+    return;
+  if (conn->rcv_state == 1)
+    remaining = conn->rcv_data.rcv_msg_size - conn->rcv_end_pos;
+  if (remaining >= CMSG_RCV_BUF_SIZE) {
+    bytes = socket_receive (conn, 
+      conn->rcv_data.rcv_msg + conn->rcv_end_pos, remaining, NULL);
+    if (bytes > 0) {
+      conn->rcv_end_pos += bytes;
+      if (conn->rcv_end_pos == conn->rcv_data.rcv_msg_size)
+        deliver_msg (conn, handle_msg);
+    }
+  } else {
+    bytes = socket_receive (conn, conn->rs->rcv_buf, CMSG_RCV_BUF_SIZE, NULL);
+    if (bytes > 0)
+      rtn = conn_feed (conn, conn->rs->rcv_buf, (size_t) bytes, handle_msg);
+  }
+  STAT_INC (conn->rs, recv_calls);
+  if (bytes == 0)
+    printf ("Sender %d closed\n", conn->rcv_data.sock);
+  else if (bytes < 0)
+    dbg_err (conn->oserr, "Error receiving msg\n");
+  if ((bytes <= 0) || (rtn < 0))
+    server_drop_conn (conn, handle_msg);
+  else
+    conn_check_pause (conn);
+}
+
+// writes queued frames to a writable connection
+void server_flush_conn (struct connection *conn, process_message_t handle_msg)
+{
+  int rtn;
+
+  pthread_mutex_lock (&conn->rs->list_mutex);
+  rtn = conn_flush_outq (conn);
+  pthread_mutex_unlock (&conn->rs->list_mutex);
+  if (rtn < 0)
+    server_drop_conn (conn, handle_msg);
+}
+
+// list_mutex must be held
+void server_close_conn (struct connection *conn)
+{
+  struct reactor_stuff *rs = conn->rs;
+
+  conn_table_remove (&rs->conns, conn);
+  printf ("Closing connection for socket %d\n", conn->rcv_data.sock);
+  conn_unpause (conn);
+  if (rs->epoll_fd != -1)
+    epoll_ctl (rs->epoll_fd, EPOLL_CTL_DEL, conn->rcv_data.sock, NULL);
+  shutdown_connection (conn);
+  conn_put (conn);
+}
+
+int server_receive_msgs (struct reactor_stuff *rs, process_message_t handle_msg)
+{
+  int i, rtn;
+  int error_cnt = 0;
+  struct connection *conn;
+  
+  CONN_TABLE_FOREACH (rs->conns, i, conn) {
+    if (conn->snd_selected)
+      server_flush_conn (conn, handle_msg);
+    if (conn->rcv_selected)
+      server_receive_conn (conn, handle_msg);
+  }
+
+  pthread_mutex_lock (&rs->list_mutex);
+  CONN_TABLE_FOREACH (rs->conns, i, conn)
+    if (conn->rcv_state == -2) {
+        server_close_conn (conn);
+        error_cnt++;
+    }
+  pthread_mutex_unlock (&rs->list_mutex);
+
+   if (error_cnt == 0)
+     return 0;
+   if (rs->conns.count != 0)
+     return 0;
+
+   return -1;
+}
+
+
+// only the connections epoll reports ready are visited
+int server_epoll_loop (struct reactor_stuff *rs, process_message_t handle_msg,
+  bool *terminated)
+{
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+  struct connection *conn;
+  int i, n, count;
+  uint64_t wakeups;
+  char inbuf[10];
+
+  while (1)
+  {
+	  count = wait_server_ready_epoll (rs, events, terminated);
+	  if (count < 0)
+	    return count;
+	  for (i=0; i<count; i++) {
+	    if (events[i].data.ptr == EPOLL_LISTEN_TAG (rs)) {
+	      for (n=0; n<EPOLL_MAX_ACCEPTS; n++)
+	        if (server_accept (rs, handle_msg) > 0)
+	          break;
+	      continue;
+	    }
+	    if (events[i].data.ptr == EPOLL_STDIN_TAG) { // key pressed
+	      fgets (inbuf, 10, stdin);
+	      return 0;
+	    }
+	    if (events[i].data.ptr == EPOLL_WAKEUP_TAG (rs)) {
+	      read (rs->wakeup_fd, &wakeups, sizeof (wakeups));
+	      continue;
+	    }
+	    conn = (struct connection *) events[i].data.ptr;
+	    if (events[i].events & EPOLLOUT)
+	      server_flush_conn (conn, handle_msg);
+	    if (events[i].events & ~EPOLLOUT)
+	      server_receive_conn (conn, handle_msg);
+	    if (conn->rcv_state == -2) {
+	      pthread_mutex_lock (&rs->list_mutex);
+	      server_close_conn (conn);
+	      pthread_mutex_unlock (&rs->list_mutex);
+	    }
+	  }
+	  reactor_resume_reads (rs, handle_msg);
+	  reactor_slow_consumers (rs, handle_msg);
+	  if (reactor_stopped (rs, terminated))
+	    return 0;
+  }
+}
+
+// a dropped connection is freed once its last io_uring request completes
+void uring_release_conn (struct connection *conn)
+{
+  if (__atomic_load_n (&conn->uring_pending, __ATOMIC_ACQUIRE) != 0)
+    return;
+  DL_DELETE (conn->rs->uring.closing_list, conn);
+  close (conn->rcv_data.sock);
+  free_conn_bufs (conn);
+  conn_put (conn);
+}
+
+// keeps a buf a paused connection read, out of the ring, so the kernel
+// runs short of bufs instead of the heap growing
+void uring_hold_buf (struct connection *conn, unsigned short bid, 
+  unsigned len)
+{
+  struct uring_stuff *ur = &conn->rs->uring;
+
+  ur->held_len[bid] = len;
+  ur->held_next[bid] = -1;
+  if (conn->held_tail == -1)
+    conn->held_head = bid;
+  else
+    ur->held_next[conn->held_tail] = bid;
+  conn->held_tail = bid;
+}
+
+// gives back the bufs a dropped connection held
+void uring_drop_held (struct connection *conn)
+{
+  int bid;
+
+  while (conn->held_head != -1) {
+    bid = conn->held_head;
+    conn->held_head = conn->rs->uring.held_next[bid];
+    uring_recycle_buf (conn->rs, bid);
+  }
+  conn->held_tail = -1;
+}
+
+void uring_drop_conn (struct connection *conn, process_message_t handle_msg)
+{
+  if (conn->rcv_state == -2)
+    return;
+  uring_drop_held (conn);
+  pthread_mutex_lock (&conn->rs->list_mutex);
+  conn->rcv_state = -2;
+  conn_table_remove (&conn->rs->conns, conn);
+  conn_unpause (conn);
+  pthread_mutex_unlock (&conn->rs->list_mutex);
+  conn_event (conn, CMSG_ACTION_CONN_DROPPED, handle_msg);
+  DL_APPEND (conn->rs->uring.closing_list, conn);
+  printf ("Closing connection for socket %d\n", conn->rcv_data.sock);
+  // ends the multishot recv. the socket is closed on release,
+  // so its number cannot be reused while requests are in flight
+  shutdown (conn->rcv_data.sock, SHUT_RDWR);
+}
+
+void uring_arm_recv (struct connection *conn, process_message_t handle_msg)
+{
+  __atomic_fetch_add (&conn->uring_pending, 1, __ATOMIC_ACQ_REL);
+  if (uring_queue (conn->rs, IORING_OP_RECV, conn->rcv_data.sock, NULL, 0,
+	(unsigned long) conn | URING_TAG_RECV) != 0) {
+    __atomic_fetch_sub (&conn->uring_pending, 1, __ATOMIC_ACQ_REL);
+    uring_drop_conn (conn, handle_msg);
+  }
+}
+
+// feeds a buf to the parser and gives it back to the ring
+void uring_feed_buf (struct connection *conn, unsigned short bid, 
+  unsigned len, process_message_t handle_msg)
+{
+  char *buf = conn->rs->uring.bufs + (size_t) bid * URING_BUF_SIZE;
+
+  STAT_INC (conn->rs, recv_calls);
+  if (conn_feed (conn, buf, len, handle_msg) != 0)
+    uring_drop_conn (conn, handle_msg);
+  else
+    conn_check_pause (conn);
+  uring_recycle_buf (conn->rs, bid);
+}
+
+// feeds the bufs held while paused, oldest first, until it pauses again
+void uring_feed_held (struct connection *conn, process_message_t handle_msg)
+{
+  struct uring_stuff *ur = &conn->rs->uring;
+  int bid;
+
+  while ((conn->held_head != -1) && !conn->rd_paused && 
+         (conn->rcv_state >= 0)) {
+    bid = conn->held_head;
+    conn->held_head = ur->held_next[bid];
+    if (conn->held_head == -1)
+      conn->held_tail = -1;
+    uring_feed_buf (conn, bid, ur->held_len[bid], handle_msg);
+  }
+}
+
+void uring_recv_done (struct connection *conn, struct io_uring_cqe *cqe,
+  process_message_t handle_msg)
+{
+  unsigned short bid;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    bid = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if ((cqe->res <= 0) || (conn->rcv_state < 0))
+      uring_recycle_buf (conn->rs, bid);
+    else if (conn->rd_paused || (conn->held_head != -1))
+      uring_hold_buf (conn, bid, (unsigned) cqe->res);
+    else
+      uring_feed_buf (conn, bid, (unsigned) cqe->res, handle_msg);
+  }
+  if (cqe->flags & IORING_CQE_F_MORE)
+    return;
+  __atomic_fetch_sub (&conn->uring_pending, 1, __ATOMIC_ACQ_REL);
+  if (conn->rcv_state >= 0) {
+    // multishot ends on EOF and errors, when the kernel runs out of
+    // provided buffers, which are refilled before the rearm, and when a
+    // pause cancels it
+    if ((cqe->res > 0) || (cqe->res == -ENOBUFS) || 
+        (cqe->res == -ECANCELED)) {
+      if (conn->rd_paused)
+        conn->recv_stopped = true;
+      else
+        uring_arm_recv (conn, handle_msg);
+      return;
+    }
+    if (cqe->res == 0)
+      printf ("Sender %d closed\n", conn->rcv_data.sock);
+    else
+      dbg_err (-cqe->res, "Error receiving msg\n");
+    uring_drop_conn (conn, handle_msg);
+  }
+  if (conn->rcv_state == -2)
+    uring_release_conn (conn);
+}
+
+// list_mutex must be held. Starts a sendmsg over the frames at the head
+// of the outq. Sends on a socket are kept one at a time, since a second
+// one in flight could overtake a short first one
+int uring_start_send (struct connection *conn)
+{
+  struct out_frame *frame;
+  uring_send_t *req;
+  int i, n = 0;
+
+  if (conn->send_inflight || (NULL == conn->outq_head))
+    return 0;
+  for (frame = conn->outq_head; (NULL != frame) && (n < OUTQ_FLUSH_FRAMES);
+       frame = frame->next)
+    n++;
+  req = (uring_send_t *) pool_alloc (sizeof (uring_send_t) + 
+    n * sizeof (struct iovec));
+  if (NULL == req) {
+    printf ("Unable to malloc send request for socket %d\n", 
+      conn->rcv_data.sock);
+    return ENOMEM;
+  }
+  req->conn = conn;
+  for (frame = conn->outq_head, i = 0; i < n; frame = frame->next, i++) {
+    req->vec[i].iov_base = frame->data + frame->sent;
+    req->vec[i].iov_len = frame->len - frame->sent;
+  }
+  memset (&req->mh, 0, sizeof (req->mh));
+  req->mh.msg_iov = req->vec;
+  req->mh.msg_iovlen = n;
+  conn->inflight_frames = n;
+  __atomic_fetch_add (&conn->uring_pending, 1, __ATOMIC_ACQ_REL);
+  if (uring_queue (conn->rs, IORING_OP_SENDMSG, conn->rcv_data.sock, &req->mh, 1,
+	(unsigned long) req | URING_TAG_SEND) != 0) {
+    __atomic_fetch_sub (&conn->uring_pending, 1, __ATOMIC_ACQ_REL);
+    pool_free (req);
+    return EAGAIN;
+  }
+  conn->send_inflight = true;
+  STAT_INC (conn->rs, send_calls);
+  return 0;
+}
+
+void uring_send_done (uring_send_t *req, int res, process_message_t handle_msg)
+{
+  struct connection *conn = req->conn;
+  bool failed = false;
+
+  pool_free (req);
+  pthread_mutex_lock (&conn->rs->list_mutex);
+  conn->send_inflight = false;
+  if (res < 0) {
+    dbg_err (-res, "Error sending msg\n");
+    failed = true;
+  } else if (conn->rcv_state >= 0) {
+    outq_consume (conn, (size_t) res);
+    if (uring_start_send (conn) != 0)
+      failed = true;
+  }
+  pthread_mutex_unlock (&conn->rs->list_mutex);
+  __atomic_fetch_sub (&conn->uring_pending, 1, __ATOMIC_ACQ_REL);
+  if (failed)
+    uring_drop_conn (conn, handle_msg);
+  if (conn->rcv_state == -2)
+    uring_release_conn (conn);
+}
+
+// list_mutex must be held, so conn cannot be dropped underneath us.
+// the frame is copied to the outq because it must outlive the call
+int uring_send_msgv (struct connection *conn, int flags, int msg_type,
+  const struct iovec *iov, int iovcnt)
+{
+  unsigned char header[MSG_HEADER_MAX];
+  size_t header_len;
+  int rtn;
+
+  header_len = make_msg_header (header, conn->rcv_data.protocol, flags,
+    msg_type, iov_total (iov, iovcnt));
+  rtn = conn_queue_frame (conn, header, header_len, iov, iovcnt, 0);
+  if (rtn != 0)
+    return rtn;
+  rtn = uring_start_send (conn);
+  if (rtn != 0)
+    return rtn;
+  // sends made by handlers go in with the reactor's next io_uring_enter.
+  // other threads submit now, along with anything else queued
+  if (!pthread_equal (pthread_self (), conn->rs->uring.reactor_thread))
+    uring_enter (conn->rs, uring_sq_pending (conn->rs), 0, 0, NULL, 0);
+  return 0;
+}
+
+int server_uring_loop (struct reactor_stuff *rs, process_message_t handle_msg,
+  bool *terminated)
+{
+  struct uring_stuff *ur = &rs->uring;
+  struct __kernel_timespec timeout;
+  struct io_uring_getevents_arg arg;
+  struct io_uring_cqe *cqe;
+  struct connection *conn;
+  unsigned head, tail;
+  unsigned long tag;
+  int rtn, sock, wait_msecs;
+  char inbuf[10];
+
+  ur->reactor_thread = pthread_self ();
+  if (uring_queue (rs, IORING_OP_ACCEPT, rs->listen_sock, NULL, 0, 
+	URING_TAG_ACCEPT) != 0)
+    return -1;
+  if (WATCH_KEYPRESS (rs))
+    uring_queue (rs, IORING_OP_POLL_ADD, STDIN_FILENO, NULL, 0, URING_TAG_STDIN);
+  memset (&arg, 0, sizeof (arg));
+  arg.sigmask_sz = _NSIG / 8;
+  // no timespec waits until a completion
+  wait_msecs = reactor_wait_msecs (terminated);
+  if (wait_msecs >= 0) {
+    timeout.tv_sec = wait_msecs / 1000;
+    timeout.tv_nsec = (long) (wait_msecs % 1000) * 1000000;
+    arg.ts = (unsigned long) &timeout;
+  }
+
+  while (1)
+  {
+    STAT_INC (rs, wait_calls);
+    rtn = uring_enter (rs, uring_sq_pending (rs), 1, 
+      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof (arg));
+    if ((rtn < 0) && (errno != ETIME) && (errno != EINTR)) {
+      dbg_err (errno, "Error on io_uring_enter for receive\n");
+      return -1;
+    }
+    head = *ur->cq_head;
+    tail = __atomic_load_n (ur->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (reactor_stopped (rs, terminated))
+        return 0;
+      continue;
+    }
+    for (; head != tail; head++) {
+      cqe = &ur->cqes[head & *ur->cq_mask];
+      tag = (unsigned long) cqe->user_data;
+      switch (tag & URING_TAG_MASK) {
+        case URING_TAG_ACCEPT:
+          STAT_INC (rs, accept_calls);
+          if (cqe->res >= 0) {
+            sock = cqe->res;
+            printf ("Accepted %d\n", sock);
+            conn = server_add_conn (rs, sock, handle_msg);
+            if (NULL != conn)
+              uring_arm_recv (conn, handle_msg);
+          } else
+            dbg_err (-cqe->res, "Accept error on receive socket: %s\n");
+          if (!(cqe->flags & IORING_CQE_F_MORE))
+            uring_queue (rs, IORING_OP_ACCEPT, rs->listen_sock, NULL, 0, 
+              URING_TAG_ACCEPT);
+          break;
+        case URING_TAG_STDIN: // key pressed
+          __atomic_store_n (ur->cq_head, head + 1, __ATOMIC_RELEASE);
+          fgets (inbuf, 10, stdin);
+          return 0;
+        case URING_TAG_RECV:
+          uring_recv_done ((struct connection *) tag, cqe, handle_msg);
+          break;
+        case URING_TAG_SEND:
+          uring_send_done ((uring_send_t *) (tag & ~URING_TAG_MASK), cqe->res,
+            handle_msg);
+          break;
+        case URING_TAG_NOP:
+          break;
+      }
+    }
+    __atomic_store_n (ur->cq_head, head, __ATOMIC_RELEASE);
+    reactor_resume_reads (rs, handle_msg);
+    reactor_slow_consumers (rs, handle_msg);
+    uring_publish_bufs (rs);
+    if (reactor_stopped (rs, terminated))
+      return 0;
+  }
+}
+
+int server_select_loop (struct reactor_stuff *rs, process_message_t handle_msg,
+  bool *terminated)
+{
+  int rtn;
+  char inbuf[10];
+
+  while (1)
+  {
+	  rtn = wait_server_ready (rs, terminated);
+	  if (rtn < 0)
+	    return rtn;
+	  if (rtn & 1)
+	    server_accept (rs, handle_msg);
+	  if (rtn & 2)
+	    server_receive_msgs (rs, handle_msg);
+	  reactor_resume_reads (rs, handle_msg);
+	  reactor_slow_consumers (rs, handle_msg);
+	  if (WATCH_KEYPRESS (rs)) {
+	    if (rtn & 4) { // key pressed
+	      fgets (inbuf, 10, stdin);
+	      return 0;
+	    }
+	  }
+	  if (reactor_stopped (rs, terminated))
+	    return 0;
+  }
+}
+
+// has every reactor stop, and wakes them to see it. Any thread
+void server_stop (struct cmsg_server *srv)
+{
+  int i;
+
+  __atomic_store_n (&srv->stopping, true, __ATOMIC_RELEASE);
+  for (i=0; i<srv->reactor_count; i++)
+    reactor_wake (&srv->reactors[i]);
+}
+
+// runs one reactor until it stops. The others then stop too
+void reactor_loop (struct reactor_stuff *rs)
+{
+  struct cmsg_server *srv = rs->srv;
+
+  // printed once, as the reactor blocks no longer than it has to
+  if (NULL != WAITING_MSG (rs))
+    printf ("%s", srv->waiting_msg);
+  if (srv->reactor == CMSG_REACTOR_EPOLL)
+    server_epoll_loop (rs, srv->handle_msg, srv->terminated);
+  else if (srv->reactor == CMSG_REACTOR_IO_URING)
+    server_uring_loop (rs, srv->handle_msg, srv->terminated);
+  else
+    server_select_loop (rs, srv->handle_msg, srv->terminated);
+  server_stop (srv);
+}
+
+void *reactor_thread (void *arg)
+{
+  reactor_loop ((struct reactor_stuff *) arg);
+  return NULL;
+}
+
+int cmsg_srv_run (cmsg_server_t *srv, process_message_t handle_msg, 
+  bool *terminated)
+{
+  int i, started;
+
+  pthread_mutex_lock (&srv->connect_mutex);
+  if (!srv->is_connected) {
+    printf ("server not connected\n");
+    pthread_mutex_unlock (&srv->connect_mutex);
+    return ENOTCONN;
+  }
+  if (srv->is_listening) {
+    printf ("server already listening for messages\n");
+    pthread_mutex_unlock (&srv->connect_mutex);
+    return EALREADY;
+  }
+  srv->is_listening = true;
+  srv->handle_msg = handle_msg;
+  srv->terminated = terminated;
+  pthread_mutex_unlock (&srv->connect_mutex);
+
+  if (workers_start (srv) != 0)
+    server_stop (srv);
+  // reactor 0 runs here, the rest on their own threads
+  for (started=1; started<srv->reactor_count; started++)
+    if (pthread_create (&srv->reactors[started].thread, NULL, 
+	  reactor_thread, &srv->reactors[started]) != 0) {
+      printf ("Unable to start reactor thread %d\n", started);
+      server_stop (srv);
+      break;
+    }
+  reactor_loop (&srv->reactors[0]);
+  for (i=1; i<started; i++)
+    pthread_join (srv->reactors[i].thread, NULL);
+  workers_stop (srv);
+  printf ("Exiting cmsg_server_listen_for_msgs\n");
+  shutdown_server (srv);
+  return 0;
+}
+
+int cmsg_server_listen_for_msgs (process_message_t handle_msg, bool *terminated)
+{
+  return cmsg_srv_run (&SRV, handle_msg, terminated);
+}
+
+int cmsg_srv_stop (cmsg_server_t *srv)
+{
+  pthread_mutex_lock (&srv->connect_mutex);
+  if (!srv->is_connected) {
+    pthread_mutex_unlock (&srv->connect_mutex);
+    return ENOTCONN;
+  }
+  server_stop (srv);
+  pthread_mutex_unlock (&srv->connect_mutex);
+  return 0;
+}
+
+int cmsg_server_stop (void)
+{
+  return cmsg_srv_stop (&SRV);
+}
+
+// header goes in its own iovec, so the payload is never copied
+// sends header then the iovec parts with one sendmsg
+ssize_t send_framev (int sock, const unsigned char *header, 
+  size_t header_len, const struct iovec *iov, int iovcnt, int flags)
+{
+  struct iovec vec[iovcnt+1];
+  struct msghdr mh;
+
+  vec[0].iov_base = (void *) header;
+  vec[0].iov_len = header_len;
+  memcpy (vec+1, iov, iovcnt * sizeof (struct iovec));
+  memset (&mh, 0, sizeof (mh));
+  mh.msg_iov = vec;
+  mh.msg_iovlen = iovcnt+1;
+  return sendmsg (sock, &mh, flags);
+}
+
+// header goes in its own iovec, so the payload is never copied
+int __send_msgv (int sock, int protocol, int hdr_flags, int msg_type,
+  const struct iovec *iov, int iovcnt, bool non_block)
+{
+  int flags = 0;
+  int rtn;
+  ssize_t bytes;
+  size_t sz_msg, header_len;
+  unsigned char header[MSG_HEADER_MAX];
+
+  if ((iovcnt < 0) || (iovcnt >= IOV_MAX)) {
+    printf ("Invalid iovec count %d for socket %d\n", iovcnt, sock);
+    return EINVAL;
+  }
+  sz_msg = iov_total (iov, iovcnt);
+  rtn = check_msg_size (protocol, msg_type, sz_msg);
+  if (rtn != 0) {
+    printf ("Unable to frame %zu byte msg of type %d for socket %d\n",
+      sz_msg, msg_type, sock);
+    return rtn;
+  }
+  header_len = make_msg_header (header, protocol, hdr_flags, msg_type, sz_msg);
+
+#if 0
+  if (wait_send_ready () < 0)
+     return -1;
+#endif
+  sz_msg += header_len;
+  if (non_block)
+    flags = MSG_DONTWAIT;
+  bytes = send_framev (sock, header, header_len, iov, iovcnt, flags);
+  if (bytes < 0) { 
+	dbg_err (errno, "Error sending msg\n");
+	return errno;
+  }
+  if (bytes != sz_msg) {
+	printf ("Not all bytes sent, just %d\n", bytes);
+	return EIO;
+  }
+  return 0;
+}
+
+/*------------------------------------------------------------------
+ * Send coalescing
+ *  After cmsg_client_coalesce, sends on a client connection are
+ *  framed into its coalesce buffer instead of going out a syscall
+ *  each. The buffer is written once it fills, on cmsg_client_flush, or
+ *  flush_usecs after the first frame went into it. One flusher thread,
+ *  started by the first connection to ask for a deadline, keeps every
+ *  waiting buffer's deadline, soonest first, and sleeps until the next
+ *  one. send_mutex covers a connection's buffer, FLUSHER.mutex the
+ *  deadline list.
+---------------------------------------------------------------------*/
+
+static struct flusher_stuff {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;	// a sooner deadline, on CLOCK_MONOTONIC
+  pthread_cond_t done;	// busy was cleared
+  pthread_once_t once;
+  bool started;
+  struct client_conn *pending;	// by deadline, soonest first
+  struct client_conn *busy;	// being flushed by the thread
+} FLUSHER = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+  .once = PTHREAD_ONCE_INIT,
+  .started = false,
+  .pending = NULL,
+  .busy = NULL
+};
+
+uint64_t monotonic_ns (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+// writes all of buf, however many sends it takes
+int client_send_all (struct client_conn *conn, const char *buf, size_t len)
+{
+  ssize_t bytes;
+
+  while (len > 0) {
+    bytes = send (conn->sock, buf, len, MSG_NOSIGNAL);
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      conn->oserr = errno;
+      dbg_err (errno, "Error sending coalesced msgs\n");
+      return conn->oserr;
+    }
+    buf += bytes;
+    len -= (size_t) bytes;
+  }
+  return 0;
+}
+
+// a buffer was written, so its deadline goes
+void flusher_remove (struct client_conn *conn)
+{
+  pthread_mutex_lock (&FLUSHER.mutex);
+  if (conn->flush_queued) {
+    DL_DELETE2 (FLUSHER.pending, conn, flush_prev, flush_next);
+    conn->flush_queued = false;
+  }
+  pthread_mutex_unlock (&FLUSHER.mutex);
+}
+
+// a first frame went into an empty buffer
+void flusher_add (struct client_conn *conn)
+{
+  struct client_conn *el;
+
+  conn->flush_deadline = monotonic_ns () + 
+    (uint64_t) conn->flush_usecs * 1000;
+  pthread_mutex_lock (&FLUSHER.mutex);
+  if (!conn->flush_queued) {
+    // deadlines mostly come in order, so look from the tail
+    el = (NULL != FLUSHER.pending) ? FLUSHER.pending->flush_prev : NULL;
+    while ((NULL != el) && (el->flush_deadline > conn->flush_deadline))
+      el = (el == FLUSHER.pending) ? NULL : el->flush_prev;
+    DL_APPEND_ELEM2 (FLUSHER.pending, el, conn, flush_prev, flush_next);
+    conn->flush_queued = true;
+    if (FLUSHER.pending == conn)
+      pthread_cond_signal (&FLUSHER.cond);
+  }
+  pthread_mutex_unlock (&FLUSHER.mutex);
+}
+
+// writes the coalesce buffer. send_mutex must be held
+int client_flush_locked (struct client_conn *conn)
+{
+  int rtn;
+
+  if (conn->coalesce_len == 0)
+    return 0;
+  if (conn->flush_usecs != 0)
+    flusher_remove (conn);
+  rtn = client_send_all (conn, conn->coalesce_buf, conn->coalesce_len);
+  conn->coalesce_len = 0;
+  if (rtn != 0)
+    __atomic_store_n (&conn->send_err, rtn, __ATOMIC_RELEASE);
+  return rtn;
+}
+
+void *flusher_thread (void *arg)
+{
+  struct client_conn *conn;
+  struct timespec wake;
+
+  pthread_mutex_lock (&FLUSHER.mutex);
+  while (true) {
+    conn = FLUSHER.pending;
+    if (NULL == conn) {
+      pthread_cond_wait (&FLUSHER.cond, &FLUSHER.mutex);
+      continue;
+    }
+    if (conn->flush_deadline > monotonic_ns ()) {
+      wake.tv_sec = (time_t) (conn->flush_deadline / 1000000000);
+      wake.tv_nsec = (long) (conn->flush_deadline % 1000000000);
+      pthread_cond_timedwait (&FLUSHER.cond, &FLUSHER.mutex, &wake);
+      continue;
+    }
+    DL_DELETE2 (FLUSHER.pending, conn, flush_prev, flush_next);
+    conn->flush_queued = false;
+    FLUSHER.busy = conn;
+    pthread_mutex_unlock (&FLUSHER.mutex);
+    pthread_mutex_lock (&conn->send_mutex);
+    client_flush_locked (conn);
+    pthread_mutex_unlock (&conn->send_mutex);
+    pthread_mutex_lock (&FLUSHER.mutex);
+    FLUSHER.busy = NULL;
+    pthread_cond_broadcast (&FLUSHER.done);
+  }
+  return NULL;
+}
+
+void flusher_start (void)
+{
+  pthread_condattr_t attr;
+  pthread_t tid;
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&FLUSHER.cond, &attr);
+  pthread_condattr_destroy (&attr);
+  if (pthread_create (&tid, NULL, flusher_thread, NULL) != 0) {
+    printf ("Unable to start client flusher thread\n");
+    return;
+  }
+  pthread_detach (tid);
+  FLUSHER.started = true;
+}
+
+// Frames a msg into the coalesce buffer, writing the buffer first if
+// the frame does not fit. A frame as big as the buffer is sent on its
+// own. send_mutex must be held
+int client_coalesce_msgv (struct client_conn *conn, int msg_type,
+  const struct iovec *iov, int iovcnt)
+{
+  size_t sz_msg, header_len;
+  unsigned char header[MSG_HEADER_MAX];
+  char *pos;
+  int i, rtn;
+
+  rtn = __atomic_load_n (&conn->send_err, __ATOMIC_ACQUIRE);
+  if (rtn != 0)
+    return rtn;
+  if ((iovcnt < 0) || (iovcnt >= IOV_MAX)) {
+    printf ("Invalid iovec count %d for socket %d\n", iovcnt, conn->sock);
+    return EINVAL;
+  }
+  sz_msg = iov_total (iov, iovcnt);
+  rtn = check_msg_size (conn->protocol, msg_type, sz_msg);
+  if (rtn != 0) {
+    printf ("Unable to frame %zu byte msg of type %d for socket %d\n",
+      sz_msg, msg_type, conn->sock);
+    return rtn;
+  }
+  header_len = make_msg_header (header, conn->protocol, 0, msg_type, sz_msg);
+  if (conn->coalesce_len + header_len + sz_msg > conn->coalesce_size) {
+    rtn = client_flush_locked (conn);
+    if (rtn != 0)
+      return rtn;
+  }
+  if (header_len + sz_msg >= conn->coalesce_size)
+    return __send_msgv (conn->sock, conn->protocol, 0, msg_type, 
+      iov, iovcnt, false);
+  if ((conn->coalesce_len == 0) && (conn->flush_usecs != 0))
+    flusher_add (conn);
+  pos = conn->coalesce_buf + conn->coalesce_len;
+  memcpy (pos, header, header_len);
+  pos += header_len;
+  for (i=0; i<iovcnt; i++) {
+    memcpy (pos, iov[i].iov_base, iov[i].iov_len);
+    pos += iov[i].iov_len;
+  }
+  conn->coalesce_len = pos - conn->coalesce_buf;
+  if (conn->coalesce_len == conn->coalesce_size)
+    return client_flush_locked (conn);
+  return 0;
+}
+
+int cmsg_client_coalesce (struct client_conn *conn, size_t flush_bytes,
+  unsigned int flush_usecs)
+{
+  char *buf = NULL;
+  int nodelay = 1;
+  int rtn;
+
+  if (-1 == conn->sock) {
+    printf ("Invalid socket for cmsg_client_coalesce\n");
+    return EBADF;
+  }
+  if (flush_bytes != 0) {
+    if (flush_usecs != 0) {
+      pthread_once (&FLUSHER.once, flusher_start);
+      if (!FLUSHER.started)
+        return EAGAIN;
+    }
+    // the flushes are the batching, so Nagle only adds delay
+    if (setsockopt (conn->sock, IPPROTO_TCP, TCP_NODELAY, 
+        &nodelay, sizeof (nodelay)) < 0) {
+      conn->oserr = errno;
+      dbg_err (errno, "Unable to set TCP_NODELAY on socket %d\n", conn->sock);
+      return errno;
+    }
+    buf = (char *) malloc (flush_bytes);
+    if (NULL == buf) {
+      printf ("Unable to malloc %zu byte coalesce buffer\n", flush_bytes);
+      return ENOMEM;
+    }
+  }
+  pthread_mutex_lock (&conn->send_mutex);
+  rtn = client_flush_locked (conn);
+  free (conn->coalesce_buf);
+  conn->coalesce_buf = buf;
+  conn->coalesce_size = flush_bytes;
+  conn->flush_usecs = flush_usecs;
+  pthread_mutex_unlock (&conn->send_mutex);
+  return rtn;
+}
+
+int cmsg_client_flush (struct client_conn *conn)
+{
+  int rtn;
+
+  pthread_mutex_lock (&conn->send_mutex);
+  rtn = client_flush_locked (conn);
+  pthread_mutex_unlock (&conn->send_mutex);
+  return rtn;
+}
+
+// writes what is buffered, and waits out a flush the flusher thread
+// has started, before the connection goes away
+void client_coalesce_end (struct client_conn *conn)
+{
+  if (NULL == conn->coalesce_buf)
+    return;
+  cmsg_client_flush (conn);
+  pthread_mutex_lock (&FLUSHER.mutex);
+  if (conn->flush_queued) {
+    DL_DELETE2 (FLUSHER.pending, conn, flush_prev, flush_next);
+    conn->flush_queued = false;
+  }
+  while (FLUSHER.busy == conn)
+    pthread_cond_wait (&FLUSHER.done, &FLUSHER.mutex);
+  pthread_mutex_unlock (&FLUSHER.mutex);
+  free (conn->coalesce_buf);
+  conn->coalesce_buf = NULL;
+  conn->coalesce_size = 0;
+}
+
+int client_send_queued (struct client_conn *conn, int rtn);
+
+int cmsg_client_sendv_type (struct client_conn *conn, int msg_type,
+  const struct iovec *iov, int iovcnt, bool non_block)
+{
+  int rtn;
+
+  if (-1 == conn->sock) {
+    printf ("Invalid socket for cmsg_client_send\n");
+    return EBADF;
+  }
+  pthread_mutex_lock (&conn->send_mutex);
+  // msgs this thread queued before go out first, even when another
+  // thread has the combining flag but not yet the mutex
+  rtn = 0;
+  if (NULL != __atomic_load_n (&conn->sendq, __ATOMIC_SEQ_CST))
+    rtn = client_send_queued (conn, 0);
+  if ((rtn == 0) && (conn->coalesce_size != 0))
+    rtn = client_coalesce_msgv (conn, msg_type, iov, iovcnt);
+  else if (rtn == 0)
+    rtn = __send_msgv (conn->sock, conn->protocol, 0, msg_type, 
+      iov, iovcnt, non_block);
+  pthread_mutex_unlock (&conn->send_mutex);
+  return rtn;
+}
+
+int cmsg_client_sendv (struct client_conn *conn, 
+  const struct iovec *iov, int iovcnt, bool non_block)
+{
+  return cmsg_client_sendv_type (conn, 0, iov, iovcnt, non_block);
+}
+
+int cmsg_client_send (struct client_conn *conn, const char *msg, size_t sz_msg, bool non_block)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *) msg;
+  iov.iov_len = sz_msg;
+  return cmsg_client_sendv (conn, &iov, 1, non_block);
+}
+
+/*------------------------------------------------------------------
+ * Combining send queue
+ *  cmsg_client_qsend encodes the frame into a pool buffer and pushes
+ *  it on the connection's sendq, a lock-free stack. Whichever producer
+ *  then wins the combining flag takes the whole stack and writes it,
+ *  oldest first, many frames to a sendmsg, while the others return at
+ *  once. The combiner holds send_mutex while it writes, so queued
+ *  sends and cmsg_client_send can be mixed on one connection.
+---------------------------------------------------------------------*/
+
+// a frame waiting on a client's sendq
+typedef struct client_frame {
+  struct client_frame *next;
+  size_t len;
+  char data[];
+} client_frame_t;
+
+void free_client_frames (struct client_frame *frame)
+{
+  struct client_frame *next;
+
+  for (; NULL != frame; frame = next) {
+    next = frame->next;
+    pool_free (frame);
+  }
+}
+
+// writes frames, oldest first, until all are sent or the socket fails.
+// Frees them either way. send_mutex must be held
+int client_write_frames (struct client_conn *conn, struct client_frame *fifo)
+{
+  struct iovec vec[OUTQ_FLUSH_FRAMES];
+  struct client_frame *frame, *next;
+  struct msghdr mh;
+  ssize_t bytes;
+  int i, count;
+
+  while (NULL != fifo) {
+    count = 0;
+    for (frame = fifo; (NULL != frame) && (count < OUTQ_FLUSH_FRAMES);
+        frame = frame->next) {
+      vec[count].iov_base = frame->data;
+      vec[count].iov_len = frame->len;
+      count++;
+    }
+    memset (&mh, 0, sizeof (mh));
+    mh.msg_iov = vec;
+    mh.msg_iovlen = count;
+    // a short write only happens on a timeout or a signal. A frame is
+    // never left cut, so carry on from where it stopped
+    while (mh.msg_iovlen > 0) {
+      bytes = sendmsg (conn->sock, &mh, MSG_NOSIGNAL);
+      if (bytes < 0) {
+        if (errno == EINTR)
+          continue;
+        conn->oserr = errno;
+        dbg_err (errno, "Error sending queued msgs\n");
+        free_client_frames (fifo);
+        return conn->oserr;
+      }
+      while ((mh.msg_iovlen > 0) && ((size_t) bytes >= mh.msg_iov->iov_len)) {
+        bytes -= mh.msg_iov->iov_len;
+        mh.msg_iov++;
+        mh.msg_iovlen--;
+      }
+      if (mh.msg_iovlen > 0) {
+        mh.msg_iov->iov_base = (char *) mh.msg_iov->iov_base + bytes;
+        mh.msg_iov->iov_len -= bytes;
+      }
+    }
+    for (i=0; i<count; i++) {
+      next = fifo->next;
+      pool_free (fifo);
+      fifo = next;
+    }
+  }
+  return 0;
+}
+
+// Writes the coalesce buffer, then everything on the sendq, oldest
+// first. Once a write has failed, with rtn or here, the frames are
+// freed instead. send_mutex must be held
+int client_send_queued (struct client_conn *conn, int rtn)
+{
+  struct client_frame *frames, *frame, *next, *fifo;
+
+  // coalesced frames were sent first
+  if (rtn == 0)
+    rtn = client_flush_locked (conn);
+  while (NULL != (frames = 
+      __atomic_exchange_n (&conn->sendq, NULL, __ATOMIC_SEQ_CST))) {
+    fifo = NULL;
+    for (frame = frames; NULL != frame; frame = next) {
+      next = frame->next;
+      frame->next = fifo;
+      fifo = frame;
+    }
+    if (rtn == 0)
+      rtn = client_write_frames (conn, fifo);
+    else
+      free_client_frames (fifo);
+    if (rtn != 0)
+      __atomic_store_n (&conn->send_err, rtn, __ATOMIC_RELEASE);
+  }
+  return rtn;
+}
+
+// Sends what is on the sendq unless another thread is already doing
+// it. The combiner keeps taking the sendq until it finds it empty
+// after giving up the flag, so no frame is left behind
+int client_combine (struct client_conn *conn)
+{
+  int rtn = 0;
+
+  while (!__atomic_exchange_n (&conn->combining, true, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock (&conn->send_mutex);
+    rtn = client_send_queued (conn, rtn);
+    pthread_mutex_unlock (&conn->send_mutex);
+    __atomic_store_n (&conn->combining, false, __ATOMIC_SEQ_CST);
+    if (NULL == __atomic_load_n (&conn->sendq, __ATOMIC_SEQ_CST))
+      break;
+  }
+  return rtn;
+}
+
+int cmsg_client_qsendv (struct client_conn *conn, int msg_type,
+  const struct iovec *iov, int iovcnt)
+{
+  struct client_frame *frame;
+  size_t sz_msg, header_len;
+  char *pos;
+  int i, rtn;
+
+  if (-1 == conn->sock) {
+    printf ("Invalid socket for cmsg_client_qsend\n");
+    return EBADF;
+  }
+  rtn = __atomic_load_n (&conn->send_err, __ATOMIC_ACQUIRE);
+  if (rtn != 0)
+    return rtn;
+  if ((iovcnt < 0) || (iovcnt >= IOV_MAX)) {
+    printf ("Invalid iovec count %d for socket %d\n", iovcnt, conn->sock);
+    return EINVAL;
+  }
+  sz_msg = iov_total (iov, iovcnt);
+  rtn = check_msg_size (conn->protocol, msg_type, sz_msg);
+  if (rtn != 0) {
+    printf ("Unable to frame %zu byte msg of type %d for socket %d\n",
+      sz_msg, msg_type, conn->sock);
+    return rtn;
+  }
+  frame = (struct client_frame *) pool_alloc (sizeof (struct client_frame) 
+    + MSG_HEADER_MAX + sz_msg);
+  if (NULL == frame) {
+    printf ("Unable to malloc queued msg for socket %d\n", conn->sock);
+    return ENOMEM;
+  }
+  header_len = make_msg_header ((unsigned char *) frame->data, 
+    conn->protocol, 0, msg_type, sz_msg);
+  pos = frame->data + header_len;
+  for (i=0; i<iovcnt; i++) {
+    memcpy (pos, iov[i].iov_base, iov[i].iov_len);
+    pos += iov[i].iov_len;
+  }
+  frame->len = header_len + sz_msg;
+  frame->next = __atomic_load_n (&conn->sendq, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&conn->sendq, &frame->next, frame, 
+      true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    ;
+  return client_combine (conn);
+}
+
+int cmsg_client_qsend (struct client_conn *conn, const char *msg, 
+  size_t sz_msg)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *) msg;
+  iov.iov_len = sz_msg;
+  return cmsg_client_qsendv (conn, 0, &iov, 1);
+}
+
+// how long a v2 hello waits on each read of the server's reply. A v1
+// server drops the hello and never answers
+#define CLIENT_HELLO_MSECS 500
+
+// Sends a v2 hello and waits for the server's. Returns 0 if the server
+// answered, -1 if it refused or did not answer in time
+int client_hello (struct client_conn *conn, uint32_t features)
+{
+  struct connection rconn;
+  unsigned char payload[4];
+  struct iovec iov;
+  int rtn;
+
+  put_be32 (payload, features);
+  iov.iov_base = payload;
+  iov.iov_len = sizeof (payload);
+  rtn = __send_msgv (conn->sock, CMSG_PROTOCOL_V2, MSG_FLAG_HELLO, 0,
+    &iov, 1, false);
+  if (rtn != 0)
+    return rtn;
+  init_connection (&rconn);
+  rconn.rcv_data.sock = conn->sock;
+  rconn.rcv_state = 0;
+  conn->rcv_wait_msecs = CLIENT_HELLO_MSECS;
+  rtn = receive_msg_header (&rconn, conn);
+  while (rtn == 0)
+    rtn = receive_msg_data (&rconn, NULL, conn);
+  conn->rcv_wait_msecs = -1;
+  if (rtn < 0) {
+    if (rconn.oserr == ETIMEDOUT)
+      printf ("No reply to hello on socket %d\n", conn->sock);
+    pool_free (rconn.rcv_data.rcv_msg);
+    return -1;
+  }
+  if (!(rconn.rcv_flags & MSG_FLAG_HELLO) || 
+      (rconn.rcv_data.rcv_msg_size < sizeof (payload))) {
+    printf ("Unexpected reply to hello on socket %d\n", conn->sock);
+    pool_free (rconn.rcv_data.rcv_msg);
+    return -1;
+  }
+  conn->protocol = CMSG_PROTOCOL_V2;
+  conn->features = features & 
+    get_be32 ((const unsigned char *) rconn.rcv_data.rcv_msg);
+  pool_free (rconn.rcv_data.rcv_msg);
+  return 0;
+}
+
+int cmsg_connect_client_v2 (struct client_conn *conn, 
+  const char *ip_addr, unsigned int port, unsigned int send_timeout_msecs,
+  uint32_t features)
+{
+  if (cmsg_connect_client (conn, ip_addr, port, send_timeout_msecs) != 0)
+    return -1;
+  if (client_hello (conn, features) == 0)
+    return 0;
+  printf ("Server did not agree to protocol v2. Reconnecting as v1\n");
+  cmsg_shutdown_client (conn);
+  return cmsg_connect_client (conn, ip_addr, port, send_timeout_msecs);
+}
+
+/*------------------------------------------------------------------
+ * Client reactor
+ *  Reads many client connections on one thread. Each client_conn
+ *  added gets a struct connection on an epoll reactor that has no
+ *  listen socket, and is read and parsed the way the server reads its
+ *  connections. The socket stays the client_conn's: sends go on it as
+ *  before, and closing it is up to the application. Only the loop
+ *  frees connections, so a remove while it runs puts the connection
+ *  on remove_list for the loop to drop.
+---------------------------------------------------------------------*/
+
+struct cmsg_client_reactor {
+  struct cmsg_server srv;	// the options the parser reads, and stats
+  struct reactor_stuff rs;
+  bool running;	// connect_mutex covers it
+  struct connection *remove_list;	// list_mutex covers it
+};
+
+int client_reactor_setup (struct cmsg_client_reactor *cr)
 {
-  if (conn->sock != -1) {
-	shutdown_sock (conn->sock);
-	pthread_mutex_destroy (&conn->send_mutex);
-	pthread_mutex_destroy (&conn->rcv_mutex);
-	conn->sock = -1;
+  static const struct cmsg_server defaults = SERVER_DEFAULTS;
+  struct reactor_stuff *rs = &cr->rs;
+
+  memcpy (&cr->srv, &defaults, sizeof (struct cmsg_server));
+  pthread_mutex_init (&cr->srv.connect_mutex, NULL);
+  cr->srv.reactor = CMSG_REACTOR_EPOLL;
+  cr->srv.terminate_on_keypress = false;
+  cr->srv.waiting_msg = NULL;
+  cr->srv.reactors = rs;
+  cr->srv.reactor_count = 1;
+  cr->running = false;
+  cr->remove_list = NULL;
+  memset (rs, 0, sizeof (*rs));
+  rs->srv = &cr->srv;
+  rs->listen_sock = -1;
+  rs->wakeup_fd = -1;
+  rs->uring.fd = -1;
+  pthread_mutex_init (&rs->list_mutex, NULL);
+  pthread_mutex_init (&rs->slab.mutex, NULL);
+  pthread_mutex_init (&rs->uring.sq_mutex, NULL);
+  rs->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (rs->epoll_fd < 0) {
+    dbg_err (errno, "Unable to create epoll instance\n");
+    return errno;
+  }
+  rs->wakeup_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (rs->wakeup_fd < 0) {
+    dbg_err (errno, "Unable to create wakeup eventfd\n");
+    return errno;
   }
+  if (epoll_add (rs, EPOLL_WAKEUP_TAG (rs), rs->wakeup_fd) != 0)
+    return errno;
+  rs->rcv_buf = (char *) malloc (CMSG_RCV_BUF_SIZE);
+  if (NULL == rs->rcv_buf) {
+    printf ("Unable to malloc client reactor read buffer\n");
+    return ENOMEM;
+  }
+  return 0;
 }
 
-
-ssize_t socket_receive (struct connection *conn, void *buf, size_t len, bool *terminated)
+cmsg_client_reactor_t *cmsg_client_reactor_create (bool zero_copy_delivery)
 {
-  ssize_t bytes;
+  struct cmsg_client_reactor *cr;
 
-  while (true) {
-    bytes = recv (conn->rcv_data.sock, buf, len, 0);
-    if (bytes >= 0)
-      return bytes;
-    if (NULL != terminated) {
-      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-        if (*terminated)
-          return -2;
-        continue; 
-      }
-    }
-    conn->oserr = errno;
-    return -1;
+  cr = (struct cmsg_client_reactor *) malloc (sizeof (*cr));
+  if (NULL == cr) {
+    printf ("Unable to malloc client reactor\n");
+    return NULL;
+  }
+  if (client_reactor_setup (cr) != 0) {
+    reactor_teardown (&cr->rs);
+    pthread_mutex_destroy (&cr->srv.connect_mutex);
+    free (cr);
+    return NULL;
   }
+  cr->srv.zero_copy_delivery = zero_copy_delivery;
+  return cr;
 }
 
-int receive_msg_header (struct connection *conn, bool *terminated)
+int cmsg_client_reactor_add (cmsg_client_reactor_t *cr, 
+  struct client_conn *cconn, void *user_data)
 {
-  int sock = conn->rcv_data.sock;
-  ssize_t bytes;
-  size_t msg_size;
-  unsigned char header[4];
+  struct reactor_stuff *rs = &cr->rs;
+  struct connection *conn;
+  int rtn = 0;
 
-  bytes = socket_receive (conn, header, 4, terminated);
-  if (bytes < 0) { 
-    if (bytes == -1)
-      dbg_err (conn->oserr, "Error receiving msg header\n");
-    return bytes;
+  if (cconn->sock < 0)
+    return EBADF;
+  conn = conn_alloc (rs);
+  if (NULL == conn) {
+    printf ("Unable to malloc connection for socket %d\n", cconn->sock);
+    return ENOMEM;
   }
-  if (bytes == 0) {
-	printf ("Sender %d closed\n", sock);
-	return -1;
+  init_connection (conn);
+  conn->rs = rs;
+  conn->rcv_state = 0;
+  conn->rcv_data.sock = cconn->sock;
+  conn->rcv_data.protocol = cconn->protocol;
+  conn->rcv_data.features = cconn->features;
+  conn->rcv_data.user_data = user_data;
+  pthread_mutex_lock (&rs->list_mutex);
+  if (NULL != conn_table_find (&rs->conns, cconn->sock)) {
+    printf ("Socket %d is already on the client reactor\n", cconn->sock);
+    rtn = EEXIST;
+  } else if (conn_table_add (&rs->conns, conn) != 0)
+    rtn = ENOMEM;
+  else if (epoll_add (rs, conn, cconn->sock) != 0) {
+    rtn = errno;
+    conn_table_remove (&rs->conns, conn);
   }
-  if (bytes != 4) {
-	printf ("Expecting 4 byte msg header. Got %d bytes\n", bytes);
-	return -1;
+  pthread_mutex_unlock (&rs->list_mutex);
+  if (rtn != 0)
+    conn_free (rs, conn);
+  return rtn;
+}
+
+// the socket is left open for its client_conn. list_mutex must be held
+void client_reactor_close_conn (struct connection *conn)
+{
+  struct reactor_stuff *rs = conn->rs;
+
+  conn_table_remove (&rs->conns, conn);
+  epoll_ctl (rs->epoll_fd, EPOLL_CTL_DEL, conn->rcv_data.sock, NULL);
+  free_conn_bufs (conn);
+  conn_put (conn);
+}
+
+int cmsg_client_reactor_remove (cmsg_client_reactor_t *cr, 
+  struct client_conn *cconn)
+{
+  struct reactor_stuff *rs = &cr->rs;
+  struct connection *conn;
+  uint64_t one = 1;
+  bool wake = false;
+  int rtn = 0;
+
+  pthread_mutex_lock (&cr->srv.connect_mutex);
+  pthread_mutex_lock (&rs->list_mutex);
+  conn = conn_table_find (&rs->conns, cconn->sock);
+  if ((NULL == conn) || conn->removed)
+    rtn = ENOENT;
+  else if (!cr->running)
+    client_reactor_close_conn (conn);
+  else {
+    __atomic_store_n (&conn->removed, true, __ATOMIC_RELEASE);
+    LL_PREPEND (cr->remove_list, conn);
+    wake = true;
   }
-  if ((header[0] != MSG_HEADER_MARK) || (header[1] != MSG_HEADER_MARK)) {
-	printf ("Invalid msg header mark\n");
-	return -1;
+  pthread_mutex_unlock (&rs->list_mutex);
+  pthread_mutex_unlock (&cr->srv.connect_mutex);
+  if (wake)
+    write (rs->wakeup_fd, &one, sizeof (one));
+  return rtn;
+}
+
+// drops the connections removed since the last pass. One the server
+// closed has had CMSG_ACTION_CONN_DROPPED already
+void client_reactor_reap (struct cmsg_client_reactor *cr, 
+  process_message_t handle_msg)
+{
+  struct reactor_stuff *rs = &cr->rs;
+  struct connection *list, *conn, *tmp;
+
+  pthread_mutex_lock (&rs->list_mutex);
+  list = cr->remove_list;
+  cr->remove_list = NULL;
+  pthread_mutex_unlock (&rs->list_mutex);
+  LL_FOREACH_SAFE (list, conn, tmp) {
+    if (conn->rcv_state != -2)
+      conn_event (conn, CMSG_ACTION_CONN_DROPPED, handle_msg);
+    pthread_mutex_lock (&rs->list_mutex);
+    client_reactor_close_conn (conn);
+    pthread_mutex_unlock (&rs->list_mutex);
   }
-  msg_size = ((size_t) header[2] << 8) + (size_t) header[3]; 
-  conn->rcv_data.rcv_msg = malloc (msg_size);
-  if (NULL == conn->rcv_data.rcv_msg) {
-    printf ("Unable to malloc msg buffer for socket %d\n", sock);
-    return -1;
+}
+
+int cmsg_client_reactor_run (cmsg_client_reactor_t *cr, 
+  process_message_t handle_msg, bool *terminated)
+{
+  struct reactor_stuff *rs = &cr->rs;
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+  struct connection *conn;
+  uint64_t wakeups;
+  int i, count;
+
+  pthread_mutex_lock (&cr->srv.connect_mutex);
+  if (cr->running) {
+    printf ("client reactor already running\n");
+    pthread_mutex_unlock (&cr->srv.connect_mutex);
+    return EBUSY;
   }
-  conn->rcv_data.rcv_msg_size = msg_size;
-  conn->rcv_end_pos = 0;
-  conn->rcv_state = 1;
-  return 0;
+  cr->running = true;
+  pthread_mutex_unlock (&cr->srv.connect_mutex);
+  while (1) {
+    count = wait_server_ready_epoll (rs, events, terminated);
+    if (count <= 0)
+      break;
+    for (i=0; i<count; i++) {
+      if (events[i].data.ptr == EPOLL_WAKEUP_TAG (rs)) {
+        read (rs->wakeup_fd, &wakeups, sizeof (wakeups));
+        continue;
+      }
+      conn = (struct connection *) events[i].data.ptr;
+      if (__atomic_load_n (&conn->removed, __ATOMIC_ACQUIRE))
+        continue;
+      server_receive_conn (conn, handle_msg);
+      if (conn->rcv_state == -2) {
+        // unless the handler removed it, which leaves it to the reap
+        pthread_mutex_lock (&rs->list_mutex);
+        if (!conn->removed)
+          client_reactor_close_conn (conn);
+        pthread_mutex_unlock (&rs->list_mutex);
+      }
+    }
+    client_reactor_reap (cr, handle_msg);
+    if (reactor_stopped (rs, terminated))
+      break;
+  }
+  // removes from now on drop at once
+  pthread_mutex_lock (&cr->srv.connect_mutex);
+  cr->running = false;
+  cr->srv.stopping = false;
+  pthread_mutex_unlock (&cr->srv.connect_mutex);
+  client_reactor_reap (cr, handle_msg);
+  return (count < 0) ? -1 : 0;
 }
 
+// a stop before the run ends the next run at once
+void cmsg_client_reactor_stop (cmsg_client_reactor_t *cr)
+{
+  pthread_mutex_lock (&cr->srv.connect_mutex);
+  server_stop (&cr->srv);
+  pthread_mutex_unlock (&cr->srv.connect_mutex);
+}
 
-// returned msg must be freed
-int receive_msg_data (struct connection *conn, process_message_t handle_msg,
-  bool *terminated)
+void cmsg_client_reactor_get_stats (cmsg_client_reactor_t *cr,
+  cmsg_server_stats_t *stats)
 {
-  ssize_t bytes;
-  size_t read_len = conn->rcv_data.rcv_msg_size - conn->rcv_end_pos;
-  int sock = conn->rcv_data.sock;
-  char *buf = conn->rcv_data.rcv_msg;
+  cmsg_srv_get_stats (&cr->srv, stats);
+}
 
-  bytes = socket_receive (conn, buf+conn->rcv_end_pos, read_len, terminated);
+int cmsg_client_reactor_destroy (cmsg_client_reactor_t *cr)
+{
+  struct connection *conn;
+  int i;
 
-  if (bytes < 0) { 
-    if (bytes == -1)
-      dbg_err (conn->oserr, "Error receiving msg header\n");
-    return bytes;
+  pthread_mutex_lock (&cr->srv.connect_mutex);
+  if (cr->running) {
+    printf ("client reactor still running\n");
+    pthread_mutex_unlock (&cr->srv.connect_mutex);
+    return EBUSY;
   }
+  pthread_mutex_unlock (&cr->srv.connect_mutex);
+  pthread_mutex_lock (&cr->rs.list_mutex);
+  CONN_TABLE_FOREACH (cr->rs.conns, i, conn)
+    client_reactor_close_conn (conn);
+  pthread_mutex_unlock (&cr->rs.list_mutex);
+  reactor_teardown (&cr->rs);
+  pthread_mutex_destroy (&cr->srv.connect_mutex);
+  free (cr);
+  return 0;
+}
 
-  if (bytes > read_len) {
-    printf ("bytes received %d not eq read_len in header %u\n",
-	bytes, read_len);
-    return -1;
+int cmsg_srv_send (cmsg_server_t *srv, int sock, const char *msg, 
+  size_t sz_msg, bool non_block)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *) msg;
+  iov.iov_len = sz_msg;
+  return cmsg_srv_sendv (srv, sock, &iov, 1, non_block);
+}
+
+int cmsg_server_send (int sock, const char *msg, size_t sz_msg, bool non_block)
+{
+  return cmsg_srv_send (&SRV, sock, msg, sz_msg, non_block);
+}
+
+// list_mutex must be held. Whatever the socket does not take now is
+// queued for the reactor to send when the socket is writable, so a
+// frame is never cut short. Later msgs queue behind it
+int conn_send_msgv (struct connection *conn, int flags, int msg_type,
+  const struct iovec *iov, int iovcnt, bool non_block)
+{
+  ssize_t bytes = 0;
+  size_t sz_msg, header_len;
+  unsigned char header[MSG_HEADER_MAX];
+
+  if ((iovcnt < 0) || (iovcnt >= IOV_MAX)) {
+    printf ("Invalid iovec count %d for socket %d\n", iovcnt, 
+      conn->rcv_data.sock);
+    return EINVAL;
   }
-  conn->rcv_end_pos += bytes;
-  if (bytes < read_len) {
-    printf ("Not all bytes received, only %d of %d. Waiting for remainder\n",
-      bytes, read_len);
-    return 0;
+  sz_msg = iov_total (iov, iovcnt);
+  header_len = make_msg_header (header, conn->rcv_data.protocol, flags,
+    msg_type, sz_msg);
+  if (NULL == conn->outq_head) {
+    bytes = send_framev (conn->rcv_data.sock, header, header_len, iov, iovcnt,
+      (non_block ? MSG_DONTWAIT : 0) | MSG_NOSIGNAL);
+    STAT_INC (conn->rs, send_calls);
+    if (bytes == (ssize_t) (sz_msg + header_len))
+      return 0;
+    if (bytes < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        dbg_err (errno, "Error sending msg\n");
+        return errno;
+      }
+      bytes = 0;
+    }
   }
-  if (NULL != handle_msg)
-    handle_msg (CMSG_ACTION_MSG_RECEIVED, &conn->rcv_data);
-  conn->rcv_state = 0;
-  return 1;
+  return conn_queue_frame (conn, header, header_len, iov, iovcnt, 
+    (size_t) bytes);
 }
 
-ssize_t cmsg_client_receive (struct client_conn *cconn)
+// list_mutex must be held
+int server_send_frame (struct connection *conn, int flags, int msg_type,
+  const struct iovec *iov, int iovcnt, bool non_block)
 {
-  int rtn;
-  struct connection rconn;
+  if (conn->rs->srv->reactor == CMSG_REACTOR_IO_URING)
+    return uring_send_msgv (conn, flags, msg_type, iov, iovcnt);
+  return conn_send_msgv (conn, flags, msg_type, iov, iovcnt, non_block);
+}
 
-  pthread_mutex_lock (&cconn->rcv_mutex);
-  init_connection (&rconn);
-  rconn.rcv_data.sock = cconn->sock;
-  rconn.rcv_state = 0;
+// list_mutex must be held
+int server_send_conn (struct connection *conn, int msg_type,
+  const struct iovec *iov, int iovcnt, bool non_block)
+{
+  int rtn;
 
-  rtn = receive_msg_header (&rconn, &cconn->terminated);
-  if (rtn < 0) {
-    pthread_mutex_unlock (&cconn->rcv_mutex);
+  if ((NULL == conn) || (conn->rcv_state < 0))
+    return EBADF;
+  rtn = check_msg_size (conn->rcv_data.protocol, msg_type, 
+    iov_total (iov, iovcnt));
+  if (rtn != 0) {
+    printf ("Unable to frame msg of type %d for socket %d\n", msg_type,
+      conn->rcv_data.sock);
     return rtn;
   }
-  while (true) {
-    rtn = receive_msg_data (&rconn, NULL, &cconn->terminated);
-    if (rtn == 1) {
-      cconn->rcv_msg = rconn.rcv_data.rcv_msg;
-      cconn->rcv_msg_size = rconn.rcv_data.rcv_msg_size; 
-      cconn->rcv_count++;
-      rtn = (ssize_t) rconn.rcv_data.rcv_msg_size;
-      pthread_mutex_unlock (&cconn->rcv_mutex);
-      return rtn;
-    }
-    if (rtn < 0)
-      break;
-  }
-  pthread_mutex_unlock (&cconn->rcv_mutex);
+  rtn = server_send_frame (conn, 0, msg_type, iov, iovcnt, non_block);
+  if (rtn == 0)
+    STAT_INC (conn->rs, msgs_sent);
   return rtn;
 }
 
-int server_receive_msgs (process_message_t handle_msg)
+// Replies to a v2 client's hello with the features both sides have.
+// From then on the connection is sent v2 frames
+void server_hello (struct connection *conn, const char *msg, size_t msg_size)
 {
-  int i, rtn;
-  int error_cnt = 0;
+  unsigned char payload[4];
+  struct iovec iov;
+  uint32_t features = 0;
+
+  if (msg_size >= sizeof (payload))
+    features = get_be32 ((const unsigned char *) msg);
+  pthread_mutex_lock (&conn->rs->list_mutex);
+  conn->rcv_data.protocol = CMSG_PROTOCOL_V2;
+  conn->rcv_data.features = features & conn->rs->srv->features;
+  put_be32 (payload, conn->rcv_data.features);
+  iov.iov_base = payload;
+  iov.iov_len = sizeof (payload);
+  if (server_send_frame (conn, MSG_FLAG_HELLO, 0, &iov, 1, true) != 0)
+    printf ("Unable to answer hello on socket %d\n", conn->rcv_data.sock);
+  pthread_mutex_unlock (&conn->rs->list_mutex);
+}
+
+// a socket could belong to any reactor, so each table is searched
+int cmsg_srv_sendv (cmsg_server_t *srv, int sock, const struct iovec *iov,
+  int iovcnt, bool non_block)
+{
+  struct reactor_stuff *rs;
   struct connection *conn;
-  struct connection *tmp;
-  
-  LL_FOREACH (SRV.connection_list, conn)
-    if (conn->rcv_selected) {
-      if (conn->rcv_state == 0)
-        rtn = receive_msg_header (conn, NULL);
-      else if (conn->rcv_state == 1)
-        rtn = receive_msg_data (conn, handle_msg, NULL);
-      else
-        continue;
-      if (rtn < 0) {
-        conn->rcv_state = -2;
-        handle_msg (CMSG_ACTION_CONN_DROPPED, &conn->rcv_data);
-      }
-    }
+  int i, rtn;
 
-  pthread_mutex_lock (&SRV.list_mutex);
-  LL_FOREACH_SAFE (SRV.connection_list, conn, tmp)
-    if (conn->rcv_state == -2) {
-        LL_DELETE (SRV.connection_list, conn);
-        printf ("Closing connection for socket %d\n", conn->rcv_data.sock);
-        shutdown_connection (conn);
-        free (conn);
-        error_cnt++;
+  for (i=0; i<srv->reactor_count; i++) {
+    rs = &srv->reactors[i];
+    pthread_mutex_lock (&rs->list_mutex);
+    conn = conn_table_find (&rs->conns, sock);
+    if (NULL != conn) {
+      rtn = server_send_conn (conn, 0, iov, iovcnt, non_block);
+      pthread_mutex_unlock (&rs->list_mutex);
+      return rtn;
     }
-  pthread_mutex_unlock (&SRV.list_mutex);
+    pthread_mutex_unlock (&rs->list_mutex);
+  }
+  return EBADF;
+}
 
-   if (error_cnt == 0)
-     return 0;
-   if (NULL != SRV.connection_list)
-     return 0;
+int cmsg_server_sendv (int sock, const struct iovec *iov, int iovcnt,
+  bool non_block)
+{
+  return cmsg_srv_sendv (&SRV, sock, iov, iovcnt, non_block);
+}
 
-   return -1;
+int cmsg_srv_sendv_type (cmsg_server_t *srv, cmsg_conn_handle_t handle,
+  int msg_type, const struct iovec *iov, int iovcnt, bool non_block)
+{
+  struct reactor_stuff *rs;
+  int id = (int) ((uint32_t) handle >> HANDLE_SOCK_BITS);
+  int rtn;
+
+  if (id >= srv->reactor_count)
+    return EBADF;
+  rs = &srv->reactors[id];
+  pthread_mutex_lock (&rs->list_mutex);
+  rtn = server_send_conn (conn_table_find_handle (&rs->conns, handle), 
+    msg_type, iov, iovcnt, non_block);
+  pthread_mutex_unlock (&rs->list_mutex);
+  return rtn;
+}
+
+int cmsg_server_sendv_type (cmsg_conn_handle_t handle, int msg_type,
+  const struct iovec *iov, int iovcnt, bool non_block)
+{
+  return cmsg_srv_sendv_type (&SRV, handle, msg_type, iov, iovcnt, non_block);
 }
 
+int cmsg_srv_sendv_handle (cmsg_server_t *srv, cmsg_conn_handle_t handle, 
+  const struct iovec *iov, int iovcnt, bool non_block)
+{
+  return cmsg_srv_sendv_type (srv, handle, 0, iov, iovcnt, non_block);
+}
 
-int cmsg_server_listen_for_msgs (process_message_t handle_msg, bool *terminated)
+int cmsg_server_sendv_handle (cmsg_conn_handle_t handle, 
+  const struct iovec *iov, int iovcnt, bool non_block)
 {
+  return cmsg_srv_sendv_type (&SRV, handle, 0, iov, iovcnt, non_block);
+}
+
+// list_mutex must be held
+int server_broadcast_conn (struct connection *conn, 
+  struct shared_frame *shared)
+{
+  ssize_t bytes = 0;
   int rtn;
-  char inbuf[10];
 
-  pthread_mutex_lock (&SRV.connect_mutex);
-  if (SRV.listen_sock == -1) {
-    printf ("server not connected\n");
-    pthread_mutex_unlock (&SRV.connect_mutex);
-    return ENOTCONN;
+  if (conn->rcv_state < 0)
+    return EBADF;
+  if (conn->rs->srv->reactor == CMSG_REACTOR_IO_URING) {
+    rtn = conn_queue_shared (conn, shared, 0);
+    if (rtn == 0)
+      rtn = uring_start_send (conn);
+    return rtn;
   }
-  if (SRV.is_listening) {
-    printf ("server already listening for messages\n");
-    pthread_mutex_unlock (&SRV.connect_mutex);
-    return EALREADY;
+  if (NULL == conn->outq_head) {
+    bytes = send (conn->rcv_data.sock, shared->data, shared->len, 
+      MSG_DONTWAIT | MSG_NOSIGNAL);
+    STAT_INC (conn->rs, send_calls);
+    if (bytes == (ssize_t) shared->len)
+      return 0;
+    if (bytes < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        dbg_err (errno, "Error sending msg\n");
+        return errno;
+      }
+      bytes = 0;
+    }
   }
-  SRV.is_listening = true;
-  pthread_mutex_unlock (&SRV.connect_mutex);
+  return conn_queue_shared (conn, shared, (size_t) bytes);
+}
 
-  while (1)
-  {
-	  rtn = wait_server_ready (terminated);
-	  if (rtn < 0)
-	    break;
-	  if (rtn & 1)
-	    server_accept (handle_msg);
-	  if (rtn & 2)
-	    server_receive_msgs (handle_msg);
-	  if (SRV.terminate_on_keypress) {
-	    if (rtn & 4) { // key pressed
-	      fgets (inbuf, 10, stdin);
-	      break;
-	    }
-	  }
-	  if (NULL != terminated)
-            if (*terminated)
-	      break;
+struct shared_frame *make_shared_frame (int protocol, const char *msg, 
+  size_t sz_msg)
+{
+  struct shared_frame *shared;
+  size_t header_len;
+
+  shared = (struct shared_frame *) pool_alloc (sizeof (struct shared_frame) 
+    + MSG_HEADER_MAX + sz_msg);
+  if (NULL == shared) {
+    printf ("Unable to malloc broadcast frame\n");
+    return NULL;
   }
-  printf ("Exiting cmsg_server_listen_for_msgs\n");
-  shutdown_server ();
-  return 0;
+  shared->refs = 1;
+  header_len = make_msg_header ((unsigned char *) shared->data, protocol,
+    0, 0, sz_msg);
+  memcpy (shared->data + header_len, msg, sz_msg);
+  shared->len = header_len + sz_msg;
+  return shared;
 }
 
-int __send_msg (int sock, const char *msg, size_t sz_msg, bool non_block)
+// rs->list_mutex must be held. Returns the number sent or queued
+int reactor_broadcast (struct reactor_stuff *rs, 
+  struct shared_frame **frames, const char *msg, size_t sz_msg,
+  cmsg_broadcast_filter_t filter, cmsg_broadcast_failed_t failed, void *arg)
 {
-  int flags = 0;
-  ssize_t bytes;
-  int i;
-  char *msg_buf;
+  struct shared_frame **shared;
+  struct connection *conn;
+  int i, rtn;
+  int sent = 0;
 
-  msg_buf = malloc (sz_msg+4);
-  if (NULL == msg_buf) {
-    printf ("Unable to malloc msg buffer for socket %d\n", sock);
-    return ENOMEM;
+  CONN_TABLE_FOREACH (rs->conns, i, conn) {
+    if (conn->rcv_state < 0)
+      continue;
+    if ((NULL != filter) && !filter (&conn->rcv_data, arg))
+      continue;
+    shared = &frames[conn->rcv_data.protocol];
+    rtn = check_msg_size (conn->rcv_data.protocol, 0, sz_msg);
+    if ((rtn == 0) && (NULL == *shared)) {
+      *shared = make_shared_frame (conn->rcv_data.protocol, msg, sz_msg);
+      if (NULL == *shared)
+        rtn = ENOMEM;
+    }
+    if (rtn == 0)
+      rtn = server_broadcast_conn (conn, *shared);
+    if (rtn == 0) {
+      STAT_INC (rs, msgs_sent);
+      sent++;
+    } else if (NULL != failed)
+      failed (&conn->rcv_data, rtn, arg);
   }
-  msg_buf[0] = MSG_HEADER_MARK;
-  msg_buf[1] = MSG_HEADER_MARK;
-  msg_buf[2] = sz_msg / 256;
-  msg_buf[3] = sz_msg % 256;
-  memcpy (msg_buf+4, msg, sz_msg);
+  // the ring is gone once the server shuts down and the table empties
+  if ((rs->srv->reactor == CMSG_REACTOR_IO_URING) && (sent > 0) &&
+      !pthread_equal (pthread_self (), rs->uring.reactor_thread))
+    uring_enter (rs, uring_sq_pending (rs), 0, 0, NULL, 0);
+  return sent;
+}
 
-#if 0
-  if (wait_send_ready () < 0)
-     return -1;
-#endif
-  sz_msg += 4;
-  if (non_block)
-    flags = MSG_DONTWAIT;
-  bytes = send (sock, msg_buf, sz_msg, flags);
-  free (msg_buf);
-  if (bytes < 0) { 
-	dbg_err (errno, "Error sending msg\n");
-	return errno;
-  }
-  if (bytes != sz_msg) {
-	printf ("Not all bytes sent, just %d\n", bytes);
-	return EIO;
+int cmsg_srv_broadcast (cmsg_server_t *srv, const char *msg, size_t sz_msg,
+  cmsg_broadcast_filter_t filter, cmsg_broadcast_failed_t failed, void *arg)
+{
+  // built the first time a connection of that protocol needs it,
+  // and shared by every reactor
+  struct shared_frame *frames[CMSG_PROTOCOL_V2+1] = { NULL, NULL, NULL };
+  struct reactor_stuff *rs;
+  int i;
+  int sent = 0;
+
+  for (i=0; i<srv->reactor_count; i++) {
+    rs = &srv->reactors[i];
+    pthread_mutex_lock (&rs->list_mutex);
+    sent += reactor_broadcast (rs, frames, msg, sz_msg, filter, failed, arg);
+    pthread_mutex_unlock (&rs->list_mutex);
   }
-  return 0;
+  for (i=CMSG_PROTOCOL_V1; i<=CMSG_PROTOCOL_V2; i++)
+    if (NULL != frames[i])
+      release_shared_frame (frames[i]);
+  return sent;
 }
 
-int cmsg_client_send (struct client_conn *conn, const char *msg, size_t sz_msg, bool non_block)
+int cmsg_server_broadcast (const char *msg, size_t sz_msg,
+  cmsg_broadcast_filter_t filter, cmsg_broadcast_failed_t failed, void *arg)
 {
-  int rtn;
+  return cmsg_srv_broadcast (&SRV, msg, sz_msg, filter, failed, arg);
+}
 
-  if (-1 == conn->sock) {
-    printf ("Invalid socket for cmsg_client_send\n");
-    return EBADF;
-  }
-  pthread_mutex_lock (&conn->send_mutex);
-  rtn = __send_msg (conn->sock, msg, sz_msg, non_block);
-  pthread_mutex_unlock (&conn->send_mutex);
-  return rtn;
+int cmsg_srv_send_handle (cmsg_server_t *srv, cmsg_conn_handle_t handle, 
+  const char *msg, size_t sz_msg, bool non_block)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *) msg;
+  iov.iov_len = sz_msg;
+  return cmsg_srv_sendv_handle (srv, handle, &iov, 1, non_block);
 }
 
-int cmsg_server_send (int sock, const char *msg, size_t sz_msg, bool non_block)
+int cmsg_server_send_handle (cmsg_conn_handle_t handle, const char *msg, 
+  size_t sz_msg, bool non_block)
 {
-  int rtn = EBADF;
-  struct connection *conn;
+  return cmsg_srv_send_handle (&SRV, handle, msg, sz_msg, non_block);
+}
 
-  pthread_mutex_lock (&SRV.list_mutex);
-  LL_FOREACH (SRV.connection_list, conn)
-  {
-    if (conn->rcv_state >= 0) {
-      if (conn->rcv_data.sock == sock) {
-        rtn = __send_msg (sock, msg, sz_msg, non_block);
-        break;
-      }
-    }
+// adds the counters in from to stats
+void add_stats (cmsg_server_stats_t *stats, cmsg_server_stats_t *from)
+{
+  stats->msgs_received += __atomic_load_n (&from->msgs_received, __ATOMIC_RELAXED);
+  stats->msgs_sent += __atomic_load_n (&from->msgs_sent, __ATOMIC_RELAXED);
+  stats->wait_calls += __atomic_load_n (&from->wait_calls, __ATOMIC_RELAXED);
+  stats->accept_calls += __atomic_load_n (&from->accept_calls, __ATOMIC_RELAXED);
+  stats->recv_calls += __atomic_load_n (&from->recv_calls, __ATOMIC_RELAXED);
+  stats->send_calls += __atomic_load_n (&from->send_calls, __ATOMIC_RELAXED);
+  stats->uring_enter_calls += __atomic_load_n (&from->uring_enter_calls, __ATOMIC_RELAXED);
+  stats->conn_heap_allocs += __atomic_load_n (&from->conn_heap_allocs, __ATOMIC_RELAXED);
+  stats->handler_jobs += __atomic_load_n (&from->handler_jobs, __ATOMIC_RELAXED);
+  stats->handler_steals += __atomic_load_n (&from->handler_steals, __ATOMIC_RELAXED);
+  stats->queued_msgs += __atomic_load_n (&from->queued_msgs, __ATOMIC_RELAXED);
+  stats->queued_bytes += __atomic_load_n (&from->queued_bytes, __ATOMIC_RELAXED);
+  stats->conns_paused += __atomic_load_n (&from->conns_paused, __ATOMIC_RELAXED);
+  stats->read_pauses += __atomic_load_n (&from->read_pauses, __ATOMIC_RELAXED);
+  stats->outq_drops += __atomic_load_n (&from->outq_drops, __ATOMIC_RELAXED);
+  stats->slow_consumers += __atomic_load_n (&from->slow_consumers, __ATOMIC_RELAXED);
+  stats->slow_evictions += __atomic_load_n (&from->slow_evictions, __ATOMIC_RELAXED);
+}
+
+// the totals over every reactor
+void cmsg_srv_get_stats (cmsg_server_t *srv, cmsg_server_stats_t *stats)
+{
+  int i, count;
+
+  memset (stats, 0, sizeof (*stats));
+  add_stats (stats, &srv->stats);
+  for (i=0; i<srv->reactor_count; i++)
+    add_stats (stats, &srv->reactors[i].stats);
+  count = __atomic_load_n (&srv->worker_count, __ATOMIC_ACQUIRE);
+  for (i=0; i<count; i++)
+    add_stats (stats, &srv->workers[i].stats);
+}
+
+void cmsg_server_get_stats (cmsg_server_stats_t *stats)
+{
+  cmsg_srv_get_stats (&SRV, stats);
+}
+
+// EBUSY while the server is running. A connected server that never ran
+// is shut down first
+int cmsg_srv_destroy (cmsg_server_t *srv)
+{
+  pthread_mutex_lock (&srv->connect_mutex);
+  if (srv->is_listening) {
+    printf ("server still listening for messages\n");
+    pthread_mutex_unlock (&srv->connect_mutex);
+    return EBUSY;
   }
-  pthread_mutex_unlock (&SRV.list_mutex);
-  return rtn;
+  pthread_mutex_unlock (&srv->connect_mutex);
+  if (srv->is_connected)
+    shutdown_server (srv);
+  free (srv->reactors);
+  srv->reactors = NULL;
+  srv->reactor_count = 0;
+  free (srv->workers);
+  srv->workers = NULL;
+  if (srv != &SRV) {
+    pthread_mutex_destroy (&srv->connect_mutex);
+    free (srv);
+  }
+  return 0;
 }
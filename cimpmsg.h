@@ -17,7 +17,9 @@
 #ifndef  _CIMPMSG_H
 #define  _CIMPMSG_H
 
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <unistd.h>
 
@@ -32,29 +34,187 @@ typedef struct client_conn {
   char *rcv_msg;
   size_t rcv_msg_size;
   unsigned int rcv_count;
+  int rcv_msg_type;
+  int protocol;		// CMSG_PROTOCOL_V1, or _V2 once the server agrees
+  uint32_t features;	// feature bits the server agreed to
   bool terminated;
+  int wakeup_fd;	// eventfd a blocked receive also waits on
+  struct client_frame *sendq;	// cmsg_client_qsend frames, newest first
+  bool combining;	// a thread is writing the sendq
+  int send_err;		// a queued or coalesced send failed. Later ones return it
+  char *coalesce_buf;	// frames not yet written, after cmsg_client_coalesce
+  size_t coalesce_size;	// 0 when not coalescing
+  size_t coalesce_len;
+  unsigned int flush_usecs;
+  uint64_t flush_deadline;	// CLOCK_MONOTONIC ns
+  bool flush_queued;	// on the flusher thread's deadline list
+  struct client_conn *flush_prev;
+  struct client_conn *flush_next;
+  char *rcv_buf;	// msgs read ahead, reused from one receive to the next
+  size_t rcv_buf_size;
+  size_t rcv_head;	// the next msg's header
+  size_t rcv_tail;	// the end of what has been read
+  size_t max_msg_size;	// a bigger msg fails the receive. CMSG_MAX_MSG_SIZE
+  int rcv_wait_msecs;	// -1, or how long a receive waits for bytes
   pthread_mutex_t send_mutex;
   pthread_mutex_t rcv_mutex;
 } client_conn_t;
 
+// A v1 frame header holds a 16 bit length, so a v1 msg is at most
+// 65535 bytes. A v2 header holds a 32 bit length, a flags byte and a
+// msg type byte. A connection stays v1 unless the client asks for v2
+// with cmsg_connect_client_v2 and the server agrees.
+#define CMSG_PROTOCOL_V1	1
+#define CMSG_PROTOCOL_V2	2
+#define CMSG_V1_MAX_MSG_SIZE	65535
+#define CMSG_MAX_MSG_SIZE	(16 * 1024 * 1024)	// default max_msg_size
+
+#define CMSG_REACTOR_SELECT	0
+#define CMSG_REACTOR_EPOLL	1
+#define CMSG_REACTOR_IO_URING	2	// needs Linux 6.0 or later
+
+#define CMSG_OUTQ_DROP_NEWEST	0
+#define CMSG_OUTQ_DROP_OLDEST	1
+#define CMSG_OUTQ_DISCONNECT	2
+
 typedef struct server_opts {
   bool terminate_on_keypress;
   const char *waiting_msg;
+  int reactor;	// CMSG_REACTOR_SELECT (default), _EPOLL or _IO_URING
+  unsigned int reactor_threads;
+  // reactors to run, up to 256, each on its own thread with its own
+  // SO_REUSEPORT listen socket and connections. 0 or 1 runs a single
+  // reactor on the thread that calls cmsg_server_listen_for_msgs.
+  // The handler is called from every reactor thread at once.
+  unsigned int handler_threads;
+  // worker threads to run the handler on. 0 calls it on the reactor
+  // threads. Otherwise a connection's actions are run by one worker at
+  // a time, in order, while different connections are handled at once
+  // and a slow handler does not stall the reactor.
+  unsigned int conn_high_water_msgs;
+  size_t conn_high_water_bytes;
+  unsigned int high_water_msgs;
+  size_t high_water_bytes;
+  // with handler_threads set, limits on msgs queued for the workers and
+  // not yet handled, for one connection and for the whole server. A
+  // connection over either stops being read, so TCP pushes back on the
+  // sender, until both are at or under half the limit. 0 is no limit.
+  // The limits are checked after each read, so they can be passed by
+  // what one read holds.
+  size_t outq_max_bytes;
+  unsigned int outq_max_frames;
+  int outq_policy;
+  // limits on what is queued for a connection that is not reading fast
+  // enough, and what to do with a send that would pass them:
+  // CMSG_OUTQ_DROP_NEWEST (default) fails it with ENOBUFS,
+  // CMSG_OUTQ_DROP_OLDEST frees the oldest unsent frames to make room,
+  // CMSG_OUTQ_DISCONNECT fails it with ECONNABORTED and drops the
+  // connection. The handler gets CMSG_ACTION_SLOW_CONSUMER first.
+  // 0 is no limit.
+  unsigned int conn_pool_size;
+  // connections preallocated by cmsg_connect_server. Accepts beyond
+  // that many open connections come from the heap.
+  uint32_t features;
+  // feature bits offered to v2 clients. Their meaning is up to the
+  // application. A client gets the ones it asked for that are set here.
+  size_t stream_threshold;
+  // msgs this big or bigger are not buffered. The handler gets the
+  // payload as it arrives in CMSG_ACTION_MSG_CHUNK calls, then
+  // CMSG_ACTION_MSG_END. 0 delivers every msg whole.
+  size_t max_msg_size;
+  // a connection whose header claims a bigger payload is dropped before
+  // anything is allocated for it, streamed or not. 0 is CMSG_MAX_MSG_SIZE
+  bool zero_copy_delivery;
+  // rcv_msg points into the server's read buffer and is only valid
+  // until the handler returns. The handler must not free it.
+  // Use cmsg_msg_retain to keep a msg.
 } server_opts_t;
 
+// counters kept by the server since cmsg_connect_server, summed over
+// the reactors
+typedef struct cmsg_server_stats {
+  unsigned long msgs_received;
+  unsigned long msgs_sent;
+  unsigned long wait_calls;	// select, epoll_wait
+  unsigned long accept_calls;
+  unsigned long recv_calls;
+  unsigned long send_calls;
+  unsigned long uring_enter_calls;
+  unsigned long conn_heap_allocs;	// connections the pool had no room for
+  unsigned long handler_jobs;	// events run by handler workers
+  unsigned long handler_steals;	// connections a worker took from another
+  unsigned long queued_msgs;	// now queued for handler workers
+  unsigned long queued_bytes;
+  unsigned long conns_paused;	// now not read, over a high water mark
+  unsigned long read_pauses;
+  unsigned long outq_drops;	// frames dropped for outq limits
+  unsigned long slow_consumers;	// times a connection's outq overflowed
+  unsigned long slow_evictions;	// connections dropped for it
+} cmsg_server_stats_t;
+
+// counters kept by the msg buffer pool, for clients and server
+typedef struct cmsg_pool_stats {
+  unsigned long hits;		// allocations taken from a free list
+  unsigned long misses;		// allocations that went to malloc
+  unsigned long heap_frees;	// frees that went back to the heap
+  unsigned long remote_frees;	// given back to the allocating thread's pool
+} cmsg_pool_stats_t;
+
+// A server instance, from cmsg_srv_create. Instances share no state or
+// locks, so one process can run several on separate ports and cores.
+// The cmsg_server_ functions without a cmsg_server_t use a default
+// instance.
+typedef struct cmsg_server cmsg_server_t;
+
+// Identifies a server connection. Unlike the socket fd it is never
+// reused, so a send on a handle whose connection has dropped fails
+// with EBADF instead of reaching a later client. 0 is never valid.
+typedef uint64_t cmsg_conn_handle_t;
+
 typedef struct server_rcv_msg_data {
   int sock;
+  cmsg_conn_handle_t handle;
+  int reactor_id;	// the reactor the connection belongs to, from 0
+  cmsg_server_t *server;	// the instance the connection belongs to
   char *rcv_msg;
   size_t rcv_msg_size;
+  int msg_type;		// from the v2 header, 0 on a v1 connection
+  size_t stream_msg_size;	// whole size of a msg being streamed
+  size_t stream_pos;	// where this chunk starts in it
+  int protocol;		// CMSG_PROTOCOL_V1 or _V2
+  uint32_t features;	// negotiated with a v2 client
+  void *user_data;
+  // Belongs to the application. NULL for a new connection. Whatever the
+  // CMSG_ACTION_CONN_ADDED handler sets comes back with every msg on
+  // the connection, and with CMSG_ACTION_CONN_DROPPED so it can be freed.
 } server_rcv_msg_data_t;
 
 #define CMSG_ACTION_MSG_RECEIVED	0
 #define CMSG_ACTION_CONN_ADDED		1
 #define CMSG_ACTION_CONN_DROPPED	2
+#define CMSG_ACTION_MSG_CHUNK		3
+// rcv_msg and rcv_msg_size are the next piece of a streamed msg. They
+// point into the server's read buffer, like zero copy delivery.
+#define CMSG_ACTION_MSG_END		4
+// the streamed msg is complete. A connection dropped before then gets
+// CMSG_ACTION_CONN_DROPPED instead
+#define CMSG_ACTION_SLOW_CONSUMER	5
+// the connection's outbound queue reached its limits, and sends are
+// being dropped by outq_policy. Comes once until the queue empties,
+// from the reactor or handler thread, never from inside a send.
 
 typedef void (* process_message_t) 
     (int action_code, server_rcv_msg_data_t *rcv_msg_data);
 
+// cmsg_server_broadcast callbacks. They are called with the server's
+// connection lock held, and must not call the send functions
+typedef bool (* cmsg_broadcast_filter_t) 
+    (server_rcv_msg_data_t *rcv_msg_data, void *arg);
+// return true to send to this connection
+typedef void (* cmsg_broadcast_failed_t) 
+    (server_rcv_msg_data_t *rcv_msg_data, int err, void *arg);
+// called for each connection the msg could not be sent or queued to
+
 /*----------------------------------------------------------------------------*/
 /*                             Function Prototypes                            */
 /*----------------------------------------------------------------------------*/
@@ -63,17 +223,174 @@ int cmsg_connect_server (const char *ip_addr, unsigned int port,
   server_opts_t *options);
 int cmsg_server_listen_for_msgs (process_message_t handle_msg, bool *terminated);
 // Will exit and shutdown server if terminated flag is set,
-// or if option terminate_on_keypress specified and a key is pressed
+// or if option terminate_on_keypress specified and a key is pressed,
+// or once cmsg_server_stop is called. Nothing signals a set flag, so
+// it is looked at every 500 ms. With terminated NULL an idle server
+// sleeps until there is work to do. waiting_msg is printed once as it
+// starts listening
+int cmsg_server_stop (void);
+// Wakes the server's reactors and has cmsg_server_listen_for_msgs
+// return at once. Any thread. Returns ENOTCONN if not connected
 int cmsg_server_send (int sock, const char *msg, size_t sz_msg, bool non_block);
+int cmsg_server_sendv (int sock, const struct iovec *iov, int iovcnt,
+  bool non_block);
+// sends the iovec parts as one msg, without assembling them first
+// Whatever the socket will not take right away is queued on the
+// connection and sent by the server loop when the socket is writable,
+// so 0 can mean queued. A msg is never cut short.
+int cmsg_server_send_handle (cmsg_conn_handle_t handle, const char *msg, 
+  size_t sz_msg, bool non_block);
+int cmsg_server_sendv_handle (cmsg_conn_handle_t handle, 
+  const struct iovec *iov, int iovcnt, bool non_block);
+// same as cmsg_server_send/sendv, for the connection the handle was
+// issued to
+int cmsg_server_sendv_type (cmsg_conn_handle_t handle, int msg_type,
+  const struct iovec *iov, int iovcnt, bool non_block);
+// same as cmsg_server_sendv_handle, with msg_type (0-255) in the v2
+// header. On a v1 connection msg_type must be 0.
+// All sends return EMSGSIZE for a msg too big for the connection's
+// protocol.
+int cmsg_server_broadcast (const char *msg, size_t sz_msg,
+  cmsg_broadcast_filter_t filter, cmsg_broadcast_failed_t failed, void *arg);
+// Sends msg to every connection, or to those filter accepts (filter 
+// may be NULL). The frame is built once and shared by every outbound
+// queue it lands on, one frame per protocol in use. Never blocks.
+// Returns the number of connections it was sent or queued to
+void cmsg_server_get_stats (cmsg_server_stats_t *stats);
+
+cmsg_server_t *cmsg_srv_create (server_opts_t *options);
+// options may be NULL for the defaults. Returns NULL if out of memory
+int cmsg_srv_listen (cmsg_server_t *srv, const char *ip_addr, 
+  unsigned int port);
+// same as cmsg_connect_server, for this instance
+int cmsg_srv_run (cmsg_server_t *srv, process_message_t handle_msg, 
+  bool *terminated);
+// same as cmsg_server_listen_for_msgs, for this instance
+int cmsg_srv_send (cmsg_server_t *srv, int sock, const char *msg, 
+  size_t sz_msg, bool non_block);
+int cmsg_srv_sendv (cmsg_server_t *srv, int sock, const struct iovec *iov,
+  int iovcnt, bool non_block);
+int cmsg_srv_send_handle (cmsg_server_t *srv, cmsg_conn_handle_t handle, 
+  const char *msg, size_t sz_msg, bool non_block);
+int cmsg_srv_sendv_handle (cmsg_server_t *srv, cmsg_conn_handle_t handle, 
+  const struct iovec *iov, int iovcnt, bool non_block);
+int cmsg_srv_sendv_type (cmsg_server_t *srv, cmsg_conn_handle_t handle,
+  int msg_type, const struct iovec *iov, int iovcnt, bool non_block);
+int cmsg_srv_broadcast (cmsg_server_t *srv, const char *msg, size_t sz_msg,
+  cmsg_broadcast_filter_t filter, cmsg_broadcast_failed_t failed, void *arg);
+void cmsg_srv_get_stats (cmsg_server_t *srv, cmsg_server_stats_t *stats);
+int cmsg_srv_stop (cmsg_server_t *srv);
+// the cmsg_server_ functions of the same name, for this instance.
+// Handles and sockets are only valid on the instance that issued them
+int cmsg_srv_destroy (cmsg_server_t *srv);
+// Frees the instance once cmsg_srv_run has returned. Returns EBUSY
+// while it is running. No sends may be made on it afterwards
+char *cmsg_msg_retain (server_rcv_msg_data_t *rcv_msg_data);
+// Called from a CMSG_ACTION_MSG_RECEIVED or _MSG_CHUNK handler. Returns
+// a msg buffer the caller owns and must free. Without zero_copy_delivery
+// that is rcv_msg itself, except for a chunk.
+void cmsg_msg_free (char *msg);
+// Msg buffers from the library (rcv_msg without zero_copy_delivery,
+// client_conn.rcv_msg, cmsg_msg_retain) come from a buffer pool and
+// must be freed with cmsg_msg_free, not free.
+void cmsg_pool_get_stats (cmsg_pool_stats_t *stats);
 
 void init_client_conn (struct client_conn *conn);
 int cmsg_connect_client (struct client_conn *conn, 
   const char *ip_addr, unsigned int port, unsigned int send_timeout_msecs);
+int cmsg_connect_client_v2 (struct client_conn *conn, 
+  const char *ip_addr, unsigned int port, unsigned int send_timeout_msecs,
+  uint32_t features);
+// Connects and asks the server for protocol v2 and the given feature
+// bits. conn->protocol and conn->features tell what the server agreed to.
+// A v1 server drops the request, and the client then reconnects as v1,
+// once the server has not answered for 500 ms.
+void cmsg_client_terminate (struct client_conn *conn);
+// Sets conn->terminated and wakes a cmsg_client_receive blocked on
+// conn, which returns -2 at once. Any thread. Setting the flag alone
+// is only seen by the next receive
 void cmsg_shutdown_client (struct client_conn *conn);
-// will set conn->terminated
+// will set conn->terminated, and signal it as cmsg_client_terminate
+// does. A receiver thread should have returned before the socket is
+// closed, so terminate and join it first
 ssize_t cmsg_client_receive (struct client_conn *conn);
-// will return -1 if conn->terminated is set
+// will return -2 if conn->terminated is set. Waits for a msg without a
+// timeout, so an idle connection costs no wakeups. The msg is left in
+// conn->rcv_msg, which the caller frees with cmsg_msg_free
+ssize_t cmsg_client_receive_buf (struct client_conn *conn, const char **msg);
+// As cmsg_client_receive, but without a copy: *msg points into conn's
+// receive buffer and is only valid until the next receive on conn.
+// Returns the msg size. Msgs are read from the socket as many at a time
+// as have arrived, into a buffer of 64 KB. A bigger msg grows it until
+// it has been read, up to conn->max_msg_size
 int cmsg_client_send (struct client_conn *conn, const char *msg, size_t sz_msg, bool non_block);
+int cmsg_client_sendv (struct client_conn *conn, 
+  const struct iovec *iov, int iovcnt, bool non_block);
+int cmsg_client_sendv_type (struct client_conn *conn, int msg_type,
+  const struct iovec *iov, int iovcnt, bool non_block);
+// conn->rcv_msg_type is the type of the last msg received
+int cmsg_client_qsend (struct client_conn *conn, const char *msg, 
+  size_t sz_msg);
+int cmsg_client_qsendv (struct client_conn *conn, int msg_type,
+  const struct iovec *iov, int iovcnt);
+// For many threads sending on one connection. The msg is copied to a
+// queue without taking a lock. If no other thread is writing the queue
+// this one does, sending every queued msg, many to a sendmsg; otherwise
+// it returns at once and the writing thread sends it. Msgs from one
+// thread stay in order. Returns 0 once the msg is queued or sent, or
+// the error an earlier queued send failed with. Can be mixed with
+// cmsg_client_send on the same connection, which sends whatever is
+// queued before its own msg
+int cmsg_client_coalesce (struct client_conn *conn, size_t flush_bytes,
+  unsigned int flush_usecs);
+// From now on cmsg_client_send and the other sends on conn frame the
+// msg into a buffer of flush_bytes and return. The buffer is written
+// in one send once it is full, on cmsg_client_flush, or flush_usecs
+// after the first msg went into it (0 waits for one of the others).
+// A msg too big for the buffer is sent on its own, after it. A send
+// that fails on a flush is returned by the next send or flush.
+// Sets TCP_NODELAY. flush_bytes 0 flushes and sends each msg again
+int cmsg_client_flush (struct client_conn *conn);
+// writes what conn has coalesced. cmsg_shutdown_client does it too
+
+// A client reactor reads many client connections on one thread,
+// instead of a cmsg_client_receive thread for each, and gives their
+// msgs to a handler the way the server does, with the same parser.
+typedef struct cmsg_client_reactor cmsg_client_reactor_t;
+
+cmsg_client_reactor_t *cmsg_client_reactor_create (bool zero_copy_delivery);
+// Returns NULL on error. zero_copy_delivery is as in server_opts_t.
+// Without it the handler owns rcv_msg and frees it with cmsg_msg_free
+int cmsg_client_reactor_add (cmsg_client_reactor_t *cr, 
+  struct client_conn *conn, void *user_data);
+// The reactor reads conn from now on. The handler gets
+// CMSG_ACTION_MSG_RECEIVED for each msg, with conn->sock and user_data
+// in rcv_msg_data, and CMSG_ACTION_CONN_DROPPED if the server closes
+// it, after which conn is off the reactor. Sends on conn work as
+// before, but cmsg_client_receive must not be called on it.
+// Any thread may add. Returns EEXIST if conn is on the reactor
+int cmsg_client_reactor_remove (cmsg_client_reactor_t *cr, 
+  struct client_conn *conn);
+// Takes conn off the reactor. While the reactor runs that happens on
+// its thread, which gives the handler CMSG_ACTION_CONN_DROPPED once it
+// no longer reads conn; conn may be shut down from then on. Msgs it
+// already read may come first. Returns ENOENT if conn is not on it
+int cmsg_client_reactor_run (cmsg_client_reactor_t *cr, 
+  process_message_t handle_msg, bool *terminated);
+// Runs the reactor on the calling thread until *terminated is set or
+// cmsg_client_reactor_stop is called. terminated may be NULL; if not,
+// it is looked at every 500 ms. The handler is called on this thread,
+// so a slow one holds up every connection. Returns EBUSY if it is
+// already running, -1 on an error
+void cmsg_client_reactor_stop (cmsg_client_reactor_t *cr);
+// Wakes the reactor and has cmsg_client_reactor_run return at once.
+// Any thread
+void cmsg_client_reactor_get_stats (cmsg_client_reactor_t *cr,
+  cmsg_server_stats_t *stats);
+// msgs_received, wait_calls and recv_calls are kept
+int cmsg_client_reactor_destroy (cmsg_client_reactor_t *cr);
+// Returns EBUSY while it runs. Connections still on it are taken off
+// without a handler call, and left open
 
 
 
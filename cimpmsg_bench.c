@@ -0,0 +1,448 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <pthread.h>
+#include "cimpmsg.h"
+
+/*------------------------------------------------------------------
+ * Server send benchmark.
+ *  A child process opens <conns> client connections to an epoll
+ *  server in this process. Once all are connected, the server sends
+ *  <rounds> messages to every connection with cmsg_server_send, and
+ *  the time per send is reported.
+ *
+ *  usage: cimpmsg_bench <conns> [rounds] [port]
+ *
+ * Client send benchmark.
+ *  1, 2, 4 ... <producers> threads share one client connection to the
+ *  server and send <msgs> messages between them, first with
+ *  cmsg_client_send, which takes the send mutex, then with
+ *  cmsg_client_qsend, which combines them, then with cmsg_client_send
+ *  coalescing into a 16 KB buffer. The time per message runs until the
+ *  server has received them all.
+ *
+ *  usage: cimpmsg_bench client <producers> [msgs] [port]
+ *
+ * Client receive benchmark.
+ *  The server sends <msgs> 64 byte messages to one client connection,
+ *  which receives them with cmsg_client_receive, which copies each to a
+ *  buffer of its own, then again with cmsg_client_receive_buf, which
+ *  returns it in place. The CPU time of the receiving thread is
+ *  reported per message.
+ *
+ *  usage: cimpmsg_bench recv [msgs] [port]
+---------------------------------------------------------------------*/
+
+#define IP_ADDR "127.0.0.1"
+#define SOCK_SEND_TIMEOUT_MSEC 2000
+#define COALESCE_BYTES 16384
+#define COALESCE_USECS 1000
+
+static struct bench_stuff {
+  unsigned int conn_count;
+  unsigned int rounds;
+  unsigned int port;
+  pthread_mutex_t mutex;
+  int *socks;
+  unsigned int added;
+  unsigned long received;
+} BENCH = {
+  .rounds = 10,
+  .port = 6680,
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .added = 0,
+  .received = 0
+};
+
+static double elapsed_ns (struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9
+    + (end->tv_nsec - start->tv_nsec);
+}
+
+static void handle_msg (int action_code, server_rcv_msg_data_t *rcv_msg_data)
+{
+  if (action_code == CMSG_ACTION_CONN_ADDED) {
+    pthread_mutex_lock (&BENCH.mutex);
+    if (BENCH.added < BENCH.conn_count)
+      BENCH.socks[BENCH.added++] = rcv_msg_data->sock;
+    pthread_mutex_unlock (&BENCH.mutex);
+    return;
+  }
+  if (action_code == CMSG_ACTION_MSG_RECEIVED) {
+    cmsg_msg_free (rcv_msg_data->rcv_msg);
+    __atomic_add_fetch (&BENCH.received, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void *server_thread (void *arg)
+{
+  cmsg_server_listen_for_msgs (handle_msg, NULL);
+  return NULL;
+}
+
+// runs in the child. Holds the connections open until the parent
+// closes its end of the pipe.
+static int bench_clients (int done_fd)
+{
+  unsigned int connected;
+  struct client_conn *conns;
+  char c;
+
+  conns = (struct client_conn *) calloc (BENCH.conn_count,
+    sizeof (struct client_conn));
+  if (NULL == conns) {
+    printf ("Unable to allocate %u client connections\n", BENCH.conn_count);
+    return -1;
+  }
+  for (connected=0; connected<BENCH.conn_count; connected++)
+    if (cmsg_connect_client (&conns[connected], IP_ADDR, BENCH.port,
+	  SOCK_SEND_TIMEOUT_MSEC) < 0)
+      break;
+  if (connected < BENCH.conn_count)
+    printf ("Bench client connected %u of %u\n", connected,
+      BENCH.conn_count);
+  while (read (done_fd, &c, 1) > 0)
+    ;
+  for (connected=0; connected<BENCH.conn_count; connected++)
+    if (conns[connected].sock > 0)
+      cmsg_shutdown_client (&conns[connected]);
+  free (conns);
+  return 0;
+}
+
+struct producer {
+  pthread_t tid;
+  struct client_conn *conn;
+  unsigned long count;
+  bool queued;
+  unsigned long fails;
+};
+
+static void *producer_thread (void *arg)
+{
+  struct producer *p = (struct producer *) arg;
+  char msg[64];
+  unsigned long i;
+  int rtn;
+
+  memset (msg, 'x', sizeof (msg));
+  for (i=0; i<p->count; i++) {
+    if (p->queued)
+      rtn = cmsg_client_qsend (p->conn, msg, sizeof (msg));
+    else
+      rtn = cmsg_client_send (p->conn, msg, sizeof (msg), false);
+    if (rtn != 0)
+      p->fails++;
+  }
+  return NULL;
+}
+
+// ns per msg, from the first send until the server has them all
+static double bench_producers (struct client_conn *conn, unsigned int count,
+  unsigned long msgs, bool queued, unsigned long *fails)
+{
+  struct producer producers[count];
+  struct timespec start, end;
+  unsigned long expected;
+  unsigned int i;
+
+  __atomic_store_n (&BENCH.received, 0, __ATOMIC_RELAXED);
+  expected = 0;
+  *fails = 0;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i=0; i<count; i++) {
+    producers[i].conn = conn;
+    producers[i].count = msgs / count;
+    producers[i].queued = queued;
+    producers[i].fails = 0;
+    expected += producers[i].count;
+    if (pthread_create (&producers[i].tid, NULL, producer_thread, 
+	  &producers[i]) != 0) {
+      printf ("Error creating producer thread\n");
+      exit (4);
+    }
+  }
+  for (i=0; i<count; i++) {
+    pthread_join (producers[i].tid, NULL);
+    *fails += producers[i].fails;
+  }
+  if (conn->coalesce_size != 0)
+    cmsg_client_flush (conn);
+  expected -= *fails;
+  while (__atomic_load_n (&BENCH.received, __ATOMIC_RELAXED) < expected) {
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    if (elapsed_ns (&start, &end) > 60e9) {
+      printf ("Server received only %lu of %lu\n", BENCH.received, expected);
+      break;
+    }
+    usleep (100);
+  }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  return elapsed_ns (&start, &end) / expected;
+}
+
+static int client_bench (int argc, char *argv[])
+{
+  server_opts_t opts;
+  struct client_conn conn;
+  pthread_t tid;
+  unsigned int producers, max_producers;
+  unsigned long msgs = 200000;
+  unsigned long mutex_fails, queued_fails, coalesced_fails;
+  double mutex_ns, queued_ns, coalesced_ns;
+
+  if (argc < 3) {
+    printf ("usage: %s client <producers> [msgs] [port]\n", argv[0]);
+    return 1;
+  }
+  max_producers = (unsigned int) strtoul (argv[2], NULL, 10);
+  if (argc > 3)
+    msgs = strtoul (argv[3], NULL, 10);
+  if (argc > 4)
+    BENCH.port = (unsigned int) strtoul (argv[4], NULL, 10);
+  if ((max_producers == 0) || (msgs < max_producers)) {
+    printf ("Invalid producer count %s\n", argv[2]);
+    return 1;
+  }
+
+  memset (&opts, 0, sizeof (opts));
+  opts.reactor = CMSG_REACTOR_EPOLL;
+  if (cmsg_connect_server (IP_ADDR, BENCH.port, &opts) < 0)
+    return 4;
+  if (pthread_create (&tid, NULL, server_thread, NULL) != 0) {
+    printf ("Error creating server thread\n");
+    return 4;
+  }
+  if (cmsg_connect_client (&conn, IP_ADDR, BENCH.port, 
+	SOCK_SEND_TIMEOUT_MSEC) < 0)
+    return 4;
+
+  for (producers=1; producers<=max_producers; producers*=2) {
+    mutex_ns = bench_producers (&conn, producers, msgs, false, &mutex_fails);
+    queued_ns = bench_producers (&conn, producers, msgs, true, &queued_fails);
+    if (cmsg_client_coalesce (&conn, COALESCE_BYTES, COALESCE_USECS) != 0)
+      return 4;
+    coalesced_ns = bench_producers (&conn, producers, msgs, false, 
+      &coalesced_fails);
+    cmsg_client_coalesce (&conn, 0, 0);
+    printf ("CLIENT producers %2u  mutex ns/msg %.0f  queued ns/msg %.0f"
+      "  coalesced ns/msg %.0f  fails %lu %lu %lu\n", producers, mutex_ns, 
+      queued_ns, coalesced_ns, mutex_fails, queued_fails, coalesced_fails);
+  }
+
+  cmsg_shutdown_client (&conn);
+  cmsg_server_stop ();
+  pthread_join (tid, NULL);
+  return 0;
+}
+
+struct recv_sender {
+  pthread_t tid;
+  int sock;
+  unsigned long count;
+};
+
+static void *recv_sender_thread (void *arg)
+{
+  struct recv_sender *sender = (struct recv_sender *) arg;
+  char msg[64];
+  unsigned long i;
+
+  memset (msg, 'x', sizeof (msg));
+  for (i=0; i<sender->count; i++)
+    if (cmsg_server_send (sender->sock, msg, sizeof (msg), false) != 0) {
+      printf ("Server send failed after %lu msgs\n", i);
+      break;
+    }
+  return NULL;
+}
+
+// receiving thread CPU ns per msg
+static double bench_receive (struct client_conn *conn, unsigned long msgs,
+  bool in_place)
+{
+  struct recv_sender sender;
+  struct timespec start, end;
+  const char *msg;
+  unsigned long i;
+  ssize_t rtn;
+
+  sender.sock = BENCH.socks[0];
+  sender.count = msgs;
+  if (pthread_create (&sender.tid, NULL, recv_sender_thread, &sender) != 0) {
+    printf ("Error creating sender thread\n");
+    exit (4);
+  }
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &start);
+  for (i=0; i<msgs; i++) {
+    if (in_place)
+      rtn = cmsg_client_receive_buf (conn, &msg);
+    else {
+      rtn = cmsg_client_receive (conn);
+      if (rtn >= 0)
+        cmsg_msg_free (conn->rcv_msg);
+    }
+    if (rtn < 0) {
+      printf ("Client received only %lu of %lu\n", i, msgs);
+      break;
+    }
+  }
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &end);
+  pthread_join (sender.tid, NULL);
+  return elapsed_ns (&start, &end) / msgs;
+}
+
+static int recv_bench (int argc, char *argv[])
+{
+  server_opts_t opts;
+  struct client_conn conn;
+  struct timespec start, end;
+  pthread_t tid;
+  unsigned long msgs = 1000000;
+  unsigned int added;
+  double copied_ns, in_place_ns;
+
+  if (argc > 2)
+    msgs = strtoul (argv[2], NULL, 10);
+  if (argc > 3)
+    BENCH.port = (unsigned int) strtoul (argv[3], NULL, 10);
+  if (msgs == 0) {
+    printf ("Invalid msg count %s\n", argv[2]);
+    return 1;
+  }
+  BENCH.conn_count = 1;
+  BENCH.socks = (int *) malloc (sizeof (int));
+  if (NULL == BENCH.socks)
+    return 4;
+
+  memset (&opts, 0, sizeof (opts));
+  opts.reactor = CMSG_REACTOR_EPOLL;
+  if (cmsg_connect_server (IP_ADDR, BENCH.port, &opts) < 0)
+    return 4;
+  if (pthread_create (&tid, NULL, server_thread, NULL) != 0) {
+    printf ("Error creating server thread\n");
+    return 4;
+  }
+  if (cmsg_connect_client (&conn, IP_ADDR, BENCH.port, 
+	SOCK_SEND_TIMEOUT_MSEC) < 0)
+    return 4;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  do {
+    usleep (1000);
+    pthread_mutex_lock (&BENCH.mutex);
+    added = BENCH.added;
+    pthread_mutex_unlock (&BENCH.mutex);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+  } while ((added == 0) && (elapsed_ns (&start, &end) < 10e9));
+  if (added == 0) {
+    printf ("Client connection not added\n");
+    return 4;
+  }
+
+  copied_ns = bench_receive (&conn, msgs, false);
+  in_place_ns = bench_receive (&conn, msgs, true);
+  printf ("RECV msgs %lu  receive cpu ns/msg %.0f  receive_buf cpu ns/msg %.0f\n",
+    msgs, copied_ns, in_place_ns);
+
+  cmsg_shutdown_client (&conn);
+  cmsg_server_stop ();
+  pthread_join (tid, NULL);
+  free (BENCH.socks);
+  return 0;
+}
+
+int main (int argc, char *argv[])
+{
+  server_opts_t opts;
+  pthread_t tid;
+  struct timespec start, end;
+  int done_pipe[2];
+  pid_t child;
+  unsigned int i, r, added;
+  unsigned long sends = 0, fails = 0;
+  const char *msg = "bench";
+  double ns;
+
+  if (argc < 2) {
+    printf ("usage: %s <conns> [rounds] [port]\n", argv[0]);
+    printf ("       %s client <producers> [msgs] [port]\n", argv[0]);
+    printf ("       %s recv [msgs] [port]\n", argv[0]);
+    exit (1);
+  }
+  if (strcmp (argv[1], "client") == 0)
+    exit (client_bench (argc, argv));
+  if (strcmp (argv[1], "recv") == 0)
+    exit (recv_bench (argc, argv));
+  BENCH.conn_count = (unsigned int) strtoul (argv[1], NULL, 10);
+  if (argc > 2)
+    BENCH.rounds = (unsigned int) strtoul (argv[2], NULL, 10);
+  if (argc > 3)
+    BENCH.port = (unsigned int) strtoul (argv[3], NULL, 10);
+  BENCH.socks = (int *) malloc (BENCH.conn_count * sizeof (int));
+  if ((BENCH.conn_count == 0) || (NULL == BENCH.socks)) {
+    printf ("Invalid connection count %s\n", argv[1]);
+    exit (1);
+  }
+
+  memset (&opts, 0, sizeof (opts));
+  opts.reactor = CMSG_REACTOR_EPOLL;
+  if (cmsg_connect_server (IP_ADDR, BENCH.port, &opts) < 0)
+    exit (4);
+  if (pipe (done_pipe) < 0) {
+    printf ("Error creating pipe: %s\n", strerror (errno));
+    exit (4);
+  }
+  if (pthread_create (&tid, NULL, server_thread, NULL) != 0) {
+    printf ("Error creating server thread\n");
+    exit (4);
+  }
+
+  child = fork ();
+  if (child == 0) {
+    close (done_pipe[1]);
+    exit (bench_clients (done_pipe[0]) == 0 ? 0 : 4);
+  }
+  close (done_pipe[0]);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  while (1) {
+    pthread_mutex_lock (&BENCH.mutex);
+    added = BENCH.added;
+    pthread_mutex_unlock (&BENCH.mutex);
+    if (added == BENCH.conn_count)
+      break;
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    if (elapsed_ns (&start, &end) > 60e9) {
+      printf ("Only %u of %u connections added\n", added, BENCH.conn_count);
+      break;
+    }
+    usleep (10000);
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (r=0; r<BENCH.rounds; r++)
+    for (i=0; i<added; i++) {
+      if (cmsg_server_send (BENCH.socks[i], msg, strlen (msg) + 1, true) != 0)
+        fails++;
+      sends++;
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  ns = elapsed_ns (&start, &end);
+  printf ("BENCH conns %u  sends %lu  fails %lu  ns/send %.0f\n",
+    added, sends, fails, (sends == 0) ? 0.0 : ns / sends);
+
+  close (done_pipe[1]);
+  waitpid (child, NULL, 0);
+  cmsg_server_stop ();
+  pthread_join (tid, NULL);
+  free (BENCH.socks);
+  return 0;
+}
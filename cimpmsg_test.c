@@ -7,13 +7,17 @@
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <pthread.h>
 #include "utlist.h"
 #include "cimpmsg.h"
 
 /*------------------------------------------------------------------
- * client receive should be blocking, but have a timeout so we can
-*  detect terminate flag 
+ * client receive should be blocking, with no timeout. It also waits
+*  on the client's eventfd, which cmsg_client_terminate signals
 *  client send should be blocking
 * 
 *  server receive should be blocking
@@ -28,7 +32,14 @@ struct options {
   bool wait_send_ready;
   bool send_random;
   bool print_send_msgs;
+  bool server_send;
+  bool print_stats;
+  bool protocol_v2;
+  bool silent_server;	// accepts connections and never reads or answers
   unsigned int msg_filler;
+  unsigned int conn_count;
+  unsigned int coalesce_bytes;	// client send coalescing, 0 is off
+  unsigned int coalesce_usecs;
 } OPT;
 
 size_t msg_buf_size = 128;
@@ -42,13 +53,18 @@ struct client_stuff {
 
 typedef struct connection {
   int sock;
+  cmsg_conn_handle_t handle;
   unsigned int rcv_count;
+  unsigned int send_round;	// last server_send_to_all_clients round
+  unsigned int stream_chunks;	// of the msg being streamed
   struct connection * next;
 } connection_t;
 
 static struct server_stuff {
   server_opts_t opts;
   const char *port_str;
+  const char *bulk_port_str;
+  cmsg_server_t *bulk;	// second instance, on bulk_port_str
   bool send_process_terminated;
   pthread_mutex_t list_mutex;
   struct connection * connection_list;
@@ -57,6 +73,8 @@ static struct server_stuff {
      .opts = {.terminate_on_keypress = true,
        .waiting_msg = "Waiting for receive. Press <Enter> to terminate.\n"},
      .port_str = NULL,
+     .bulk_port_str = NULL,
+     .bulk = NULL,
      .send_process_terminated = false,
      .list_mutex = PTHREAD_MUTEX_INITIALIZER,
      .connection_list = NULL
@@ -68,7 +86,14 @@ void init_options (void)
   OPT.wait_send_ready = true;
   OPT.send_random = false;
   OPT.print_send_msgs = false;
+  OPT.server_send = true;
+  OPT.print_stats = false;
+  OPT.protocol_v2 = false;
+  OPT.silent_server = false;
   OPT.msg_filler = 0;
+  OPT.conn_count = 1;
+  OPT.coalesce_bytes = 0;
+  OPT.coalesce_usecs = 1000;
 }
 
 
@@ -121,136 +146,122 @@ unsigned int parse_num_arg (const char *arg, const char *arg_name)
 
 pthread_t client_rcv_thread_id;
 pthread_t server_send_thread_id;
+pthread_t bulk_thread_id;
 bool server_received_something = false;
+struct timespec server_first_msg_time;
+struct timespec server_last_msg_time;
 
-typedef struct {
-  int allocated, used;
-  int *sockets;
-} socket_list_t;
-
-void init_socket_list (socket_list_t *slist)
+static int create_thread (pthread_t *tid, void *(*thread_func) (void*), void *arg)
 {
-  slist->allocated = 0;
-  slist->used = 0;
-  slist->sockets = NULL;
+	int rtn = pthread_create (tid, NULL, thread_func, arg);
+	if (rtn != 0) {
+	  printf ("Error creating thread\n");
+	}
+	return rtn; 
 }
 
-void free_socket_list (socket_list_t *slist)
+void process_rcv_msg (int action_code, server_rcv_msg_data_t *rcv_msg_data);
+
+static void *bulk_server_thread (void *arg)
 {
-  if (NULL != slist->sockets)
-    free (slist->sockets);
-  init_socket_list (slist);
+  cmsg_srv_run ((cmsg_server_t *) arg, process_rcv_msg, NULL);
+  return NULL;
 }
 
-int append_to_socket_list (socket_list_t *slist, int socket)
+// runs a second server instance on its own thread, for bulk senders.
+// It only receives, and stops when the main server does
+static int start_bulk_server (pthread_t *tid)
 {
-  if (slist->allocated == 0) {
-    slist->sockets = (int *) malloc (20 * sizeof (int));
-    if (NULL == slist->sockets) {
-      printf ("Unable to allocate memory for sockets list\n");
-      return -1;
-    }
-    slist->allocated = 20;
-  }
-  if (slist->used >= slist->allocated) {
-    int new_alloc = slist->allocated + 20;
-    int *new_sockets = (int *) realloc (slist->sockets, new_alloc * sizeof(int));
-    if (NULL == new_sockets) {
-      printf ("Unable to allocate memory to expand sockets list\n");
-      return -1;
-    }
-    slist->sockets = new_sockets;
-    slist->allocated = new_alloc;
+  server_opts_t opts = SRV.opts;
+  unsigned int port = parse_num_arg (SRV.bulk_port_str, "bulk port");
+
+  if (port == (unsigned int) (-1))
+    return -1;
+  opts.terminate_on_keypress = false;
+  opts.waiting_msg = NULL;
+  SRV.bulk = cmsg_srv_create (&opts);
+  if (NULL == SRV.bulk)
+    return -1;
+  if ((cmsg_srv_listen (SRV.bulk, IP_ADDR, port) != 0) ||
+      (create_thread (tid, bulk_server_thread, SRV.bulk) != 0)) {
+    cmsg_srv_destroy (SRV.bulk);
+    SRV.bulk = NULL;
+    return -1;
   }
-  slist->sockets[slist->used++] = socket;
   return 0;
 }
 
-int find_socket_in_list (socket_list_t *slist, int socket)
-{
-  int i;
-  for (i=0; i<slist->used; i++)
-    if (socket == slist->sockets[i])
-      return i;
-  return -1;
-}
-
-static int create_thread (pthread_t *tid, void *(*thread_func) (void*), void *arg)
-{
-	int rtn = pthread_create (tid, NULL, thread_func, arg);
-	if (rtn != 0) {
-	  printf ("Error creating thread\n");
-	}
-	return rtn; 
-}
-
 static void *client_receiver_thread (void *arg)
 {
   client_conn_t *conn = (client_conn_t *) arg;
+  const char *msg;
   ssize_t rtn;
 
   //printf ("Started client receiver thread for %d\n", getpid());
   while (true) {
-    rtn = cmsg_client_receive (conn);
+    rtn = cmsg_client_receive_buf (conn, &msg);
     if (rtn < 0)
       break;
-    printf ("Client %d received: %s\n", getpid(), conn->rcv_msg);
-    free (conn->rcv_msg);
-    conn->rcv_msg = NULL;
+    printf ("Client %d received: %.*s\n", getpid(), (int) rtn, msg);
   }
   //printf ("Ending client receiver thread for %d\n", getpid());
 }
 
-void server_send_pass (socket_list_t *done_list, socket_list_t *not_done_list,
-  const char *msg)
-{
-  int rtn;
-  size_t sz_msg = strlen(msg) + 1;
-  bool found = false;
-  struct connection *conn;
+// state shared with the broadcast callbacks for one send pass
+struct send_pass {
+  unsigned int round;
+  int not_done;
+};
 
-  while (true) {
-    found = false;
-    pthread_mutex_lock (&SRV.list_mutex);
-    LL_FOREACH (SRV.connection_list, conn) {
-      if (find_socket_in_list (done_list, conn->sock) >= 0)
-        continue;
-      if (find_socket_in_list (not_done_list, conn->sock) >= 0)
-        continue;
-      found = true;
-      if (conn->rcv_count == 0) {
-        append_to_socket_list (not_done_list, conn->sock);
-        break;
-      }
-      rtn = cmsg_server_send (conn->sock, msg, sz_msg, true);
-      if ((rtn == 0) || (rtn == EBADF))
-        append_to_socket_list (done_list, conn->sock);
-      else
-        append_to_socket_list (not_done_list, conn->sock);
-      break;
-    }
-    pthread_mutex_unlock (&SRV.list_mutex);
-    if (!found)
-      break;
+// sends to clients that have sent something, and have not been sent
+// to this round. runs under the library's connection lock
+bool server_send_filter (server_rcv_msg_data_t *rcv_msg_data, void *arg)
+{
+  struct send_pass *pass = (struct send_pass *) arg;
+  connection_t *conn = (connection_t *) rcv_msg_data->user_data;
+
+  if ((NULL == conn) || (conn->send_round == pass->round))
+    return false;
+  if (__atomic_load_n (&conn->rcv_count, __ATOMIC_RELAXED) == 0) {
+    pass->not_done++;
+    return false;
   }
+  conn->send_round = pass->round;
+  return true;
+}
+
+// retried on the next pass, unless the client is not keeping up
+void server_send_failed (server_rcv_msg_data_t *rcv_msg_data, int err,
+  void *arg)
+{
+  struct send_pass *pass = (struct send_pass *) arg;
+  connection_t *conn = (connection_t *) rcv_msg_data->user_data;
+
+  if ((err == ENOBUFS) || (err == ECONNABORTED))
+    return;
+  conn->send_round = pass->round - 1;
+  pass->not_done++;
+}
+
+void server_send_pass (struct send_pass *pass, const char *msg)
+{
+  pass->not_done = 0;
+  cmsg_server_broadcast (msg, strlen(msg) + 1, server_send_filter, 
+    server_send_failed, pass);
 }
 
 int server_send_to_all_clients (const char *msg, unsigned timeout_ms,
   bool *terminated)
 {
-  int rtn;
-  socket_list_t done_list;
-  socket_list_t not_done_list;
-  struct connection *conn;
+  struct send_pass pass;
   unsigned delay = 0, total_delay = 0;
 
-  init_socket_list (&done_list);
-  init_socket_list (&not_done_list);
+  pass.round = 1;
   
   while (!server_received_something && !*terminated)
     wait_msecs (250);
 
-  server_send_pass (&done_list, &not_done_list, msg);
+  server_send_pass (&pass, msg);
 
   while (!*terminated) {
     if (delay == 0)
@@ -271,21 +282,19 @@ int server_send_to_all_clients (const char *msg, unsigned timeout_ms,
       if ((total_delay+delay) > timeout_ms)
         delay = timeout_ms - total_delay;
     wait_msecs (delay);
-    init_socket_list (&not_done_list);
-    server_send_pass (&done_list, &not_done_list, msg);
+    server_send_pass (&pass, msg);
     if (timeout_ms != 0) {
       total_delay += delay;
       if (total_delay >= timeout_ms) {
-        init_socket_list (&done_list);
+        // everyone gets the msg again
+        if (++pass.round == 0)
+          pass.round = 1;
         delay = 0;
         total_delay = 0;
       }
     }
   } // end while
-  rtn = not_done_list.used;
-  free_socket_list (&done_list);
-  free_socket_list (&not_done_list);
-  return rtn;
+  return pass.not_done;
 }
 
 static void *server_send_thread (void *arg)
@@ -334,8 +343,157 @@ void client_send_multiple (void)
 	  if (OPT.print_send_msgs)
 	    printf ("Sent msg %lu\n", i);
   }
+  if (OPT.coalesce_bytes != 0)
+    cmsg_client_flush (&CLI.conn);
+}
+
+// what the soak client's reactor has received
+static struct soak_stuff {
+  cmsg_client_reactor_t *reactor;
+  unsigned long rcv_count;
+  unsigned int dropped;
+} SOAK;
+
+void soak_rcv_msg (int action_code, server_rcv_msg_data_t *rcv_msg_data)
+{
+  if (action_code == CMSG_ACTION_CONN_DROPPED) {
+    SOAK.dropped++;
+    return;
+  }
+  if (action_code != CMSG_ACTION_MSG_RECEIVED)
+    return;
+  SOAK.rcv_count++;
+  cmsg_msg_free (rcv_msg_data->rcv_msg);
+}
+
+static void *soak_reactor_thread (void *arg)
+{
+  cmsg_client_reactor_run (SOAK.reactor, soak_rcv_msg, NULL);
+  return NULL;
 }
 
+#define SILENT_MAX_CONNS 64
+
+// a peer that accepts and then says nothing, as a v1 server does to a
+// v2 hello. Runs until <Enter>
+int silent_server (unsigned int port)
+{
+  struct sockaddr_in addr;
+  struct pollfd fds[2];
+  int conns[SILENT_MAX_CONNS];
+  int i, sock, listen_sock;
+  int conn_count = 0;
+  int on = 1;
+  char inbuf[10];
+
+  listen_sock = socket (AF_INET, SOCK_STREAM, 0);
+  if (listen_sock < 0) {
+    printf ("Unable to create silent listen socket\n");
+    return -1;
+  }
+  setsockopt (listen_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = inet_addr (IP_ADDR);
+  if ((bind (listen_sock, (struct sockaddr *) &addr, sizeof (addr)) < 0) ||
+      (listen (listen_sock, 16) < 0)) {
+    printf ("Unable to listen on port %u\n", port);
+    close (listen_sock);
+    return -1;
+  }
+  printf ("Silent on port %u. Press <Enter> to terminate.\n", port);
+  fds[0].fd = listen_sock;
+  fds[0].events = POLLIN;
+  fds[1].fd = STDIN_FILENO;
+  fds[1].events = POLLIN;
+  while (poll (fds, 2, -1) >= 0) {
+    if (fds[1].revents != 0) {
+      fgets (inbuf, 10, stdin);
+      break;
+    }
+    sock = accept (listen_sock, NULL, NULL);
+    if (sock < 0)
+      continue;
+    printf ("Accepted %d, not answering\n", sock);
+    if (conn_count < SILENT_MAX_CONNS)
+      conns[conn_count++] = sock;
+    else
+      close (sock);
+  }
+  for (i=0; i<conn_count; i++)
+    close (conns[i]);
+  close (listen_sock);
+  return 0;
+}
+
+// soak test: opens OPT.conn_count connections from this one process
+// and sends CLI.send_count messages on each, round robin. What the
+// server sends back is read on one client reactor thread
+int client_soak (unsigned int port)
+{
+  unsigned long i;
+  unsigned int c, connected;
+  size_t sz_msg;
+  char buf[msg_buf_size+OPT.msg_filler];
+  struct client_conn *conns;
+  pthread_t reactor_tid;
+  bool reactor_running = false;
+  int rtn = 0;
+
+  conns = (struct client_conn *) calloc (OPT.conn_count, 
+    sizeof (struct client_conn));
+  if (NULL == conns) {
+    printf ("Unable to allocate %u client connections\n", OPT.conn_count);
+    return -1;
+  }
+  for (connected=0; connected<OPT.conn_count; connected++)
+    if (cmsg_connect_client (&conns[connected], IP_ADDR, port, 
+	  SOCK_SEND_TIMEOUT_MSEC) < 0) {
+      rtn = -1;
+      break;
+    }
+  printf ("Soak client %d connected %u of %u\n", getpid(), connected,
+    OPT.conn_count);
+  SOAK.reactor = cmsg_client_reactor_create (false);
+  if (NULL != SOAK.reactor) {
+    for (c=0; c<connected; c++)
+      if (cmsg_client_reactor_add (SOAK.reactor, &conns[c], &conns[c]) != 0)
+        break;
+    reactor_running = 
+      (create_thread (&reactor_tid, soak_reactor_thread, NULL) == 0);
+  }
+
+  if (CLI.send_count == 0)
+    CLI.send_count = 1;
+  for (i=0; (rtn == 0) && (i<CLI.send_count); i++) {
+    make_filled_msg (CLI.send_msg, i, buf);
+    sz_msg = strlen(buf) + 1;
+    for (c=0; c<connected; c++)
+      if (cmsg_client_send (&conns[c], buf, sz_msg, false) != 0) {
+        printf ("Soak send failed on connection %u\n", c);
+        rtn = -1;
+        break;
+      }
+  }
+  printf ("Soak client %d sent %lu messages on %u connections\n",
+    getpid(), i, connected);
+  if (reactor_running) {
+    // give the server's sends time to arrive
+    wait_msecs (1000);
+    cmsg_client_reactor_stop (SOAK.reactor);
+    pthread_join (reactor_tid, NULL);
+    printf ("Soak client %d received %lu messages, %u connections dropped\n",
+      getpid(), SOAK.rcv_count, SOAK.dropped);
+  }
+  if (NULL != SOAK.reactor)
+    cmsg_client_reactor_destroy (SOAK.reactor);
+
+  for (c=0; c<connected; c++)
+    cmsg_shutdown_client (&conns[c]);
+  free (conns);
+  return rtn;
+}
 
 void show_msg (server_rcv_msg_data_t *rcv_msg_data, connection_t *conn)
 {
@@ -345,10 +503,10 @@ void show_msg (server_rcv_msg_data_t *rcv_msg_data, connection_t *conn)
   size_t bytes = rcv_msg_data->rcv_msg_size;
 
   if (NULL == conn) {
-    printf ("Message socket %d not found in list\n", rcv_msg_data->sock);
+    printf ("Message socket %d has no connection record\n", rcv_msg_data->sock);
     count = 0;
   } else {
-    count = conn->rcv_count;
+    count = __atomic_load_n (&conn->rcv_count, __ATOMIC_RELAXED);
   }
   if ((count & 0xFF) == 0) {
     printf ("RECEIVED \"%s\"\n", buf);
@@ -367,7 +525,6 @@ void show_msg (server_rcv_msg_data_t *rcv_msg_data, connection_t *conn)
 void process_rcv_msg (int action_code, server_rcv_msg_data_t *rcv_msg_data)
 {
   connection_t *conn;
-  connection_t *tmp;
 
   switch (action_code) {
     case CMSG_ACTION_CONN_ADDED:
@@ -375,35 +532,58 @@ void process_rcv_msg (int action_code, server_rcv_msg_data_t *rcv_msg_data)
       conn = (connection_t *) malloc (sizeof (connection_t));
       if (NULL != conn) {
         conn->sock = rcv_msg_data->sock;
+        conn->handle = rcv_msg_data->handle;
         conn->rcv_count = 0;
+        conn->send_round = 0;
+        conn->stream_chunks = 0;
         LL_APPEND (SRV.connection_list, conn);
+        rcv_msg_data->user_data = conn;
       } else {
         printf ("Unable to alloc memory for new connection\n");
       }
       pthread_mutex_unlock (&SRV.list_mutex);
       break;
     case CMSG_ACTION_CONN_DROPPED:
+      conn = (connection_t *) rcv_msg_data->user_data;
+      if (NULL == conn)
+        break;
       pthread_mutex_lock (&SRV.list_mutex);
-      LL_FOREACH_SAFE (SRV.connection_list, conn, tmp)
-        if (conn->sock == rcv_msg_data->sock) {
-          LL_DELETE (SRV.connection_list, conn);
-          free (conn);
-          break;
-        }
+      LL_DELETE (SRV.connection_list, conn);
       pthread_mutex_unlock (&SRV.list_mutex);
+      free (conn);
+      rcv_msg_data->user_data = NULL;
+      break;
+    case CMSG_ACTION_SLOW_CONSUMER:
+      printf ("Socket %d is not keeping up with sends\n", rcv_msg_data->sock);
+      break;
+    case CMSG_ACTION_MSG_CHUNK:
+      conn = (connection_t *) rcv_msg_data->user_data;
+      if (NULL != conn)
+        conn->stream_chunks++;
+      break;
+    case CMSG_ACTION_MSG_END:
+      conn = (connection_t *) rcv_msg_data->user_data;
+      if (NULL != conn) {
+        __atomic_add_fetch (&conn->rcv_count, 1, __ATOMIC_RELAXED);
+        printf ("RECEIVED %zu bytes streamed in %u chunks\n",
+          rcv_msg_data->stream_msg_size, conn->stream_chunks);
+        conn->stream_chunks = 0;
+      }
+      server_received_something = true;
       break;
     case CMSG_ACTION_MSG_RECEIVED:
-      conn = NULL;
-      pthread_mutex_lock (&SRV.list_mutex);
-      LL_FOREACH (SRV.connection_list, conn)
-        if (conn->sock == rcv_msg_data->sock) {
-          conn->rcv_count += 1;
-          break;
-        }
-      pthread_mutex_unlock (&SRV.list_mutex);
+      conn = (connection_t *) rcv_msg_data->user_data;
+      if (NULL != conn)
+        __atomic_add_fetch (&conn->rcv_count, 1, __ATOMIC_RELAXED);
       show_msg (rcv_msg_data, conn);
-      free (rcv_msg_data->rcv_msg);
+      if (!SRV.opts.zero_copy_delivery)
+        cmsg_msg_free (rcv_msg_data->rcv_msg);
       rcv_msg_data->rcv_msg = NULL;
+      if (OPT.print_stats) {
+        clock_gettime (CLOCK_MONOTONIC, &server_last_msg_time);
+        if (!server_received_something)
+          server_first_msg_time = server_last_msg_time;
+      }
       server_received_something = true;
       break;
     default:
@@ -411,6 +591,43 @@ void process_rcv_msg (int action_code, server_rcv_msg_data_t *rcv_msg_data)
   }
 }
 
+void print_server_stats (void)
+{
+  cmsg_server_stats_t stats;
+  cmsg_pool_stats_t pool_stats;
+  unsigned long syscalls;
+  double secs;
+
+  cmsg_server_get_stats (&stats);
+  syscalls = stats.wait_calls + stats.accept_calls + stats.recv_calls
+    + stats.send_calls + stats.uring_enter_calls;
+  if (SRV.opts.reactor == CMSG_REACTOR_IO_URING)
+    syscalls = stats.uring_enter_calls;
+  secs = (server_last_msg_time.tv_sec - server_first_msg_time.tv_sec)
+    + (server_last_msg_time.tv_nsec - server_first_msg_time.tv_nsec) / 1e9;
+  printf ("STATS msgs received %lu, sent %lu\n", stats.msgs_received,
+    stats.msgs_sent);
+  printf ("STATS waits %lu, accepts %lu, recvs %lu, sends %lu, "
+    "io_uring_enters %lu\n", stats.wait_calls, stats.accept_calls,
+    stats.recv_calls, stats.send_calls, stats.uring_enter_calls);
+  printf ("STATS connections from the heap %lu\n", stats.conn_heap_allocs);
+  if (SRV.opts.handler_threads > 0)
+    printf ("STATS handler jobs %lu, steals %lu, read pauses %lu\n",
+      stats.handler_jobs, stats.handler_steals, stats.read_pauses);
+  if (SRV.opts.outq_max_bytes > 0)
+    printf ("STATS outq drops %lu, slow consumers %lu, evicted %lu\n",
+      stats.outq_drops, stats.slow_consumers, stats.slow_evictions);
+  cmsg_pool_get_stats (&pool_stats);
+  printf ("STATS pool hits %lu, misses %lu, heap frees %lu, remote frees %lu\n",
+    pool_stats.hits, pool_stats.misses, pool_stats.heap_frees, 
+    pool_stats.remote_frees);
+  if (stats.msgs_received != 0)
+    printf ("STATS %.2f syscalls/msg\n", 
+      (double) syscalls / stats.msgs_received);
+  if (secs > 0)
+    printf ("STATS %.0f msgs/sec\n", stats.msgs_received / secs);
+}
+
 int get_args (const int argc, const char **argv)
 {
 	int i;
@@ -439,6 +656,46 @@ int get_args (const int argc, const char **argv)
 			mode = 'f';
 			continue;
 		}
+		if ((strlen(arg) == 1) && (arg[0] == 'c')) {
+			mode = 'c';
+			continue;
+		}
+		if ((strlen(arg) == 1) && (arg[0] == 't')) {
+			mode = 't';
+			continue;
+		}
+		if ((strlen(arg) == 1) && (arg[0] == 'p')) {
+			mode = 'p';
+			continue;
+		}
+		if ((strlen(arg) == 1) && (arg[0] == 'b')) {
+			mode = 'b';
+			continue;
+		}
+		if ((strlen(arg) == 1) && (arg[0] == 'j')) {
+			mode = 'j';
+			continue;
+		}
+		if ((strlen(arg) == 1) && (arg[0] == 'w')) {
+			mode = 'w';
+			continue;
+		}
+		if ((strlen(arg) == 1) && (arg[0] == 'q')) {
+			mode = 'q';
+			continue;
+		}
+		if ((strlen(arg) == 1) && (arg[0] == 'o')) {
+			mode = 'o';
+			continue;
+		}
+		if ((strlen(arg) == 1) && (arg[0] == 'g')) {
+			mode = 'g';
+			continue;
+		}
+		if ((strlen(arg) == 1) && (arg[0] == 'u')) {
+			mode = 'u';
+			continue;
+		}
 		if ((mode == 0) && (strcmp(arg, "not") == 0)) {
 			OPT.set_timeout = false;
 			continue;
@@ -451,11 +708,56 @@ int get_args (const int argc, const char **argv)
 			OPT.send_random = true;
 			continue;
 		}
+		if ((mode == 0) && (strcmp(arg, "select") == 0)) {
+			SRV.opts.reactor = CMSG_REACTOR_SELECT;
+			continue;
+		}
+		if ((mode == 0) && (strcmp(arg, "epoll") == 0)) {
+			SRV.opts.reactor = CMSG_REACTOR_EPOLL;
+			continue;
+		}
+		if ((mode == 0) && (strcmp(arg, "uring") == 0)) {
+			SRV.opts.reactor = CMSG_REACTOR_IO_URING;
+			continue;
+		}
+		if ((mode == 0) && (strcmp(arg, "oldest") == 0)) {
+			SRV.opts.outq_policy = CMSG_OUTQ_DROP_OLDEST;
+			continue;
+		}
+		if ((mode == 0) && (strcmp(arg, "evict") == 0)) {
+			SRV.opts.outq_policy = CMSG_OUTQ_DISCONNECT;
+			continue;
+		}
+		if ((mode == 0) && (strcmp(arg, "zc") == 0)) {
+			SRV.opts.zero_copy_delivery = true;
+			continue;
+		}
+		if ((mode == 0) && (strcmp(arg, "stats") == 0)) {
+			OPT.print_stats = true;
+			continue;
+		}
+		if ((mode == 0) && (strcmp(arg, "v2") == 0)) {
+			OPT.protocol_v2 = true;
+			continue;
+		}
+		if ((mode == 0) && (strcmp(arg, "silent") == 0)) {
+			OPT.silent_server = true;
+			continue;
+		}
+		if ((mode == 0) && (strcmp(arg, "nosend") == 0)) {
+			OPT.server_send = false;
+			continue;
+		}
 		if (mode == 'r') {
 			SRV.port_str = arg;
 			mode = 0;
 			continue;
 		}
+		if (mode == 'b') {
+			SRV.bulk_port_str = arg;
+			mode = 0;
+			continue;
+		}
 		if (mode == 's') {
 			CLI.port_str = arg;
 			mode = 0;
@@ -480,7 +782,70 @@ int get_args (const int argc, const char **argv)
 			mode = 0;
 			continue;
 		}
-		printf ("arg not preceded by r/s/m/n/f specifier\n");
+		if (mode == 'c') {
+			OPT.conn_count = parse_num_arg (arg, "conn_count");
+			if ((OPT.conn_count == (unsigned) -1) || (OPT.conn_count == 0))
+			  return -1;
+			mode = 0;
+			continue;
+		}
+		if (mode == 't') {
+			SRV.opts.stream_threshold = parse_num_arg (arg, "stream_threshold");
+			if (SRV.opts.stream_threshold == (unsigned) -1)
+			  return -1;
+			mode = 0;
+			continue;
+		}
+		if (mode == 'p') {
+			SRV.opts.conn_pool_size = parse_num_arg (arg, "conn_pool_size");
+			if (SRV.opts.conn_pool_size == (unsigned) -1)
+			  return -1;
+			mode = 0;
+			continue;
+		}
+		if (mode == 'j') {
+			SRV.opts.reactor_threads = parse_num_arg (arg, "reactor_threads");
+			if (SRV.opts.reactor_threads == (unsigned) -1)
+			  return -1;
+			mode = 0;
+			continue;
+		}
+		if (mode == 'w') {
+			SRV.opts.handler_threads = parse_num_arg (arg, "handler_threads");
+			if (SRV.opts.handler_threads == (unsigned) -1)
+			  return -1;
+			mode = 0;
+			continue;
+		}
+		if (mode == 'q') {
+			SRV.opts.conn_high_water_msgs = parse_num_arg (arg, "conn_high_water_msgs");
+			if (SRV.opts.conn_high_water_msgs == (unsigned) -1)
+			  return -1;
+			mode = 0;
+			continue;
+		}
+		if (mode == 'o') {
+			SRV.opts.outq_max_bytes = parse_num_arg (arg, "outq_max_bytes");
+			if (SRV.opts.outq_max_bytes == (unsigned) -1)
+			  return -1;
+			mode = 0;
+			continue;
+		}
+		if (mode == 'g') {
+			OPT.coalesce_bytes = parse_num_arg (arg, "coalesce_bytes");
+			if (OPT.coalesce_bytes == (unsigned) -1)
+			  return -1;
+			mode = 0;
+			continue;
+		}
+		if (mode == 'u') {
+			OPT.coalesce_usecs = parse_num_arg (arg, "coalesce_usecs");
+			if (OPT.coalesce_usecs == (unsigned) -1)
+			  return -1;
+			mode = 0;
+			continue;
+		}
+		printf ("arg not preceded by r/s/m/n/f/c/t/p/j/b/w/q/o/g/u specifier\n");
 		return -1;
 	} 
 	return 0;
@@ -515,14 +880,31 @@ int main (const int argc, const char **argv)
 	  unsigned int port = parse_num_arg (SRV.port_str, "port");
 	  if (port == (unsigned int) (-1))
 	    exit (4);
+	  if (OPT.silent_server) {
+	    int rtn = silent_server (port);
+	    printf ("%d Done!\n", getpid());
+	    exit (rtn == 0 ? 0 : 4);
+	  }
 	  if (cmsg_connect_server (IP_ADDR, port, &SRV.opts) != 0)
 		exit(4);
-	  if (create_thread (&server_send_thread_id, server_send_thread, NULL) == 0)
+	  if (NULL != SRV.bulk_port_str)
+	    if (start_bulk_server (&bulk_thread_id) != 0)
+	      exit(4);
+	  if (!OPT.server_send)
+	    cmsg_server_listen_for_msgs (process_rcv_msg, NULL);
+	  else if (create_thread (&server_send_thread_id, server_send_thread, NULL) == 0)
 	  {
 	    cmsg_server_listen_for_msgs (process_rcv_msg, NULL);
 	    SRV.send_process_terminated = true;
 	    pthread_join (server_send_thread_id, NULL);
 	  }
+	  if (NULL != SRV.bulk) {
+	    cmsg_srv_stop (SRV.bulk);
+	    pthread_join (bulk_thread_id, NULL);
+	    cmsg_srv_destroy (SRV.bulk);
+	  }
+	  if (OPT.print_stats)
+	    print_server_stats ();
 	  pthread_mutex_destroy (&SRV.list_mutex);
 	}
 
@@ -534,13 +916,27 @@ int main (const int argc, const char **argv)
 		printf ("Message not specified for client\n");
 		exit(4);
 	  }
-	  if (cmsg_connect_client (&CLI.conn, IP_ADDR, port, 
+	  if (OPT.conn_count > 1) {
+	    int rtn = client_soak (port);
+	    printf ("%d Done!\n", getpid());
+	    exit (rtn == 0 ? 0 : 4);
+	  }
+	  if (OPT.protocol_v2) {
+	    if (cmsg_connect_client_v2 (&CLI.conn, IP_ADDR, port, 
+		  SOCK_SEND_TIMEOUT_MSEC, 0) < 0)
+	      exit(4);
+	    printf ("Client %d using protocol v%d\n", getpid(), CLI.conn.protocol);
+	  } else if (cmsg_connect_client (&CLI.conn, IP_ADDR, port, 
 		SOCK_SEND_TIMEOUT_MSEC) < 0)
 	    exit(4);
+	  if (OPT.coalesce_bytes != 0)
+	    if (cmsg_client_coalesce (&CLI.conn, OPT.coalesce_bytes, 
+		  OPT.coalesce_usecs) != 0)
+	      exit(4);
 	  if (create_thread (&client_rcv_thread_id, client_receiver_thread, &CLI.conn) == 0)
 	  {
  	    client_send_multiple ();
-            CLI.conn.terminated = true;
+            cmsg_client_terminate (&CLI.conn);
             pthread_join (client_rcv_thread_id, NULL);
 	  }
           cmsg_shutdown_client (&CLI.conn);
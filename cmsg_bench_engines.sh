@@ -0,0 +1,24 @@
+# Runs the 24 client demo workload, without random delays, against the
+# select, epoll and io_uring server engines and prints each server's stats.
+# Uses port 6666. The server is stopped through a fifo standing in for <Enter>
+for engine in select epoll uring; do
+  rm -f bench_fifo
+  mkfifo bench_fifo
+  ./cimpmsg_test $engine stats r 6666 < bench_fifo > bench_$engine.txt &
+  exec 3> bench_fifo
+  sleep 1
+  for i in 1 5 9 13 17 21; do
+    ./cimpmsg_test s 6666 f 1000 n 300 m ThisMessageIsFromClient$i > /dev/null &
+    ./cimpmsg_test s 6666 f 2000 n 200 m ThisMessageIsFromClient$((i+1)) > /dev/null &
+    ./cimpmsg_test s 6666 f 500 n 200 m ThisMessageIsFromClient$((i+2)) > /dev/null &
+    ./cimpmsg_test s 6666 f 100 n 200 m ThisMessageIsFromClient$((i+3)) > /dev/null &
+  done
+  ./cimpmsg_test s 6666 f 8000 n 300 m ThisMessageIsFromClient25 > /dev/null
+  sleep 3
+  echo >&3
+  exec 3>&-
+  wait
+  echo "$engine:"
+  grep STATS bench_$engine.txt
+done
+rm -f bench_fifo
@@ -0,0 +1 @@
+./cimpmsg_test epoll nosend p 20000 r 6666
@@ -0,0 +1,12 @@
+# a v2 client against a peer that never answers its hello. The client
+# gives up on the hello and reconnects as v1 rather than hanging
+sleep 10 | ./cimpmsg_test silent r 6668 &
+silent=$!
+sleep 0.5
+if timeout 5 ./cimpmsg_test v2 s 6668 n 1 m ThisMessageIsFromClient1 \
+    | grep "Reconnecting as v1"; then
+  echo "silent server: ok"
+else
+  echo "silent server: FAILED"
+fi
+kill $silent
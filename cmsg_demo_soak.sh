@@ -0,0 +1,2 @@
+./cimpmsg_test s 6666 c 10000 f 100 n 20 m ThisMessageIsFromSoakClient1 &
+./cimpmsg_test s 6666 c 10000 f 100 n 20 m ThisMessageIsFromSoakClient2
@@ -0,0 +1 @@
+./cimpmsg_test v2 s 6666 f 200000 n 20 m ThisLargeMessageIsFromClient1
@@ -0,0 +1 @@
+gcc -o cimpmsg_bench cimpmsg_bench.c cimpmsg.o dbg_err.o -lpthread